@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,16 +9,59 @@
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
 
-#define DEFB (8*1024)
+#define DEFB (1024*1024)     // the read/write loop's buffer
+#define CHUNK (1L<<30)       // most asked of the kernel per call
+#define BIG (64L<<20)        // -r: files this big are copied in ranges
+#define RANGE (16L<<20)      // of this size
+#define BATCH 32             // -r: small files a worker takes at once
+#define QMAX 65536           // -r: jobs queued ahead of the workers
+
+// -r: a file, or a range of one, for the workers to copy
+typedef struct Job Job;
+struct Job {
+    Job *next;
+    char *from;
+    char *to;
+    struct stat st;
+    off_t off;
+    off_t len;       // < 0: the whole file
+    int *left;       // ranges of this file not yet done
+};
+
+// -r: a directory, its metadata set once its contents are in place
+typedef struct Dir {
+    char *to;
+    struct stat st;
+} Dir;
+
+// -r: a multiply-linked file's first copy, by source (dev, ino)
+typedef struct Link {
+    dev_t dev;
+    ino_t ino;
+    char *to;
+} Link;
 
 int failed;
 int gflag;
 int uflag;
 int xflag;
+int rflag;
+int nproc = 16;      // -j: copy threads; more keep a deep device queue busy
+mode_t cmask;
 
 void copy(char *from, char *to, int todir);
 int copy1(int fdf, int fdt, char *from, char *to);
+int copyrange(int fdf, int fdt, off_t off, off_t len, char *from, char *to);
+void copytree(char *from, char *to, struct stat *st);
+void setmeta(int fd, char *to, struct stat *st);
+void setfailed(void);
 int samefile(const char *a_path, const struct stat *a_stat, const char *b_path);
 
 int main(int argc, char *argv[]) {
@@ -30,21 +74,35 @@ int main(int argc, char *argv[]) {
         for (int j = 1; opt[j] != '\0'; j++) {
             switch (opt[j]) {
                 case 'g': gflag++; break;
+                case 'r': rflag++; break;
                 case 'u': uflag++; gflag++; break;
                 case 'x': xflag++; break;
+                case 'j':
+                    // -j n or -jn, ending this argument
+                    if (opt[j+1] != '\0')
+                        nproc = atoi(&opt[j+1]);
+                    else if (i + 1 < argc)
+                        nproc = atoi(argv[++i]);
+                    else
+                        nproc = 0;
+                    if (nproc < 1)
+                        goto usage;
+                    j = strlen(opt) - 1;
+                    break;
                 default:
-                    fprintf(stderr, "usage:\tcp [-gux] fromfile tofile\n");
-                    fprintf(stderr, "\tcp [-x] fromfile ... todir\n");
-                    exit(1);
+                    goto usage;
             }
         }
     }
 
     if (argc - i < 2) {
-        fprintf(stderr, "usage:\tcp [-gux] fromfile tofile\n");
-        fprintf(stderr, "\tcp [-x] fromfile ... todir\n");
+    usage:
+        fprintf(stderr, "usage:\tcp [-grux] [-j nproc] fromfile tofile\n");
+        fprintf(stderr, "\tcp [-rx] [-j nproc] fromfile ... todir\n");
         exit(1);
     }
+    cmask = umask(0);
+    umask(cmask);
 
     // Check if last argument is a directory
     struct stat st;
@@ -97,25 +155,29 @@ void copy(char *from, char *to, int todir) {
 
     if (stat(from, &st_from) < 0) {
         fprintf(stderr, "cp: can't stat %s: %s\n", from, strerror(errno));
-        failed = 1;
+        setfailed();
         return;
     }
 
     if (S_ISDIR(st_from.st_mode)) {
+        if (rflag) {
+            copytree(from, to, &st_from);
+            return;
+        }
         fprintf(stderr, "cp: %s is a directory\n", from);
-        failed = 1;
+        setfailed();
         return;
     }
 
     if (samefile(from, &st_from, to)) {
-        failed = 1;
+        setfailed();
         return;
     }
 
     int fdf = open(from, O_RDONLY);
     if (fdf < 0) {
         fprintf(stderr, "cp: can't open %s: %s\n", from, strerror(errno));
-        failed = 1;
+        setfailed();
         return;
     }
 
@@ -124,56 +186,107 @@ void copy(char *from, char *to, int todir) {
     if (fdt < 0) {
         fprintf(stderr, "cp: can't create %s: %s\n", to, strerror(errno));
         close(fdf);
-        failed = 1;
+        setfailed();
         return;
     }
 
-    if (copy1(fdf, fdt, from, to) == 0 && (xflag || gflag || uflag)) {
-        // Try to preserve metadata
-        struct stat st_to;
-        if (fstat(fdt, &st_to) == 0) {
-            if (xflag) {
-                // Preserve modification time and mode
-                struct timespec times[2];
-                times[0] = st_from.st_atim;
-                times[1] = st_from.st_mtim;
-                futimens(fdt, times);
+    if (copy1(fdf, fdt, from, to) == 0)
+        setmeta(fdt, to, &st_from);
 
-                fchmod(fdt, st_from.st_mode);
-            }
-            if (uflag) {
-                // Preserve ownership
-                fchown(fdt, st_from.st_uid, st_from.st_gid);
-            }
-            if (gflag) {
-                // In Plan9, gflag sets group — in Linux covered above by fchown
-                // Already done with fchown above if uflag or gflag set
-            }
+    close(fdf);
+    close(fdt);
+}
+
+// Preserve what the flags ask for of st on to, open on fd, or by
+// name if fd is -1 (not following a symlink).
+void setmeta(int fd, char *to, struct stat *st) {
+    if (!(xflag || gflag || uflag))
+        return;
+    if (xflag) {
+        // Preserve modification time and mode
+        struct timespec times[2];
+        times[0] = st->st_atim;
+        times[1] = st->st_mtim;
+        if (fd >= 0) {
+            futimens(fd, times);
+            fchmod(fd, st->st_mode);
         } else {
-            fprintf(stderr, "cp: warning: can't fstat %s: %s\n", to, strerror(errno));
+            utimensat(AT_FDCWD, to, times, AT_SYMLINK_NOFOLLOW);
+            if (!S_ISLNK(st->st_mode))
+                chmod(to, st->st_mode);
         }
     }
+    if (uflag) {
+        // Preserve ownership
+        if (fd >= 0)
+            fchown(fd, st->st_uid, st->st_gid);
+        else
+            lchown(to, st->st_uid, st->st_gid);
+    }
+    if (gflag) {
+        // In Plan9, gflag sets group — in Linux covered above by fchown
+        // Already done with fchown above if uflag or gflag set
+    }
+}
 
-    close(fdf);
-    close(fdt);
+// failed is set from the -r workers too
+void setfailed(void) {
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+// Can a fast path fail over to the next one from here?  Only if it
+// isn't supported for these files and nothing has been copied yet.
+static int unsupported(int err) {
+    return err == EXDEV || err == EINVAL || err == ENOSYS ||
+        err == EOPNOTSUPP || err == ENOTTY || err == EBADF || err == EPERM;
 }
 
+// Copy fdf to fdt, both at offset 0 with fdt empty, cheapest way
+// first: share the blocks (reflink on btrfs, xfs), then let the
+// kernel copy (server-side on NFS 4.2), then sendfile, and only
+// then move the bytes through a buffer here.  A fast path that
+// stops partway leaves both offsets after what it did copy, so the
+// next one carries on from there.  One that copies nothing at all
+// and says so with 0, as sysfs and some FUSE files do despite their
+// size, is passed over like one that fails.
 int copy1(int fdf, int fdt, char *from, char *to) {
+    struct stat st;
+    ssize_t n;
+    int rv = 0;
+
+    // files like those in /proc claim size 0 but aren't empty
+    if (fstat(fdf, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        if (ioctl(fdt, FICLONE, fdf) == 0)
+            return 0;
+
+        off_t done = 0;
+        while ((n = copy_file_range(fdf, NULL, fdt, NULL, CHUNK, 0)) > 0)
+            done += n;
+        if (n == 0 && done > 0)
+            return 0;
+        if (n < 0 && (done > 0 || !unsupported(errno)))
+            goto fail;
+
+        while ((n = sendfile(fdt, fdf, NULL, CHUNK)) > 0)
+            done += n;
+        if (n == 0 && done > 0)
+            return 0;
+        if (n < 0 && (done > 0 || !unsupported(errno)))
+            goto fail;
+    }
+
     char *buf = malloc(DEFB);
     if (buf == NULL) {
         fprintf(stderr, "cp: memory allocation failed\n");
-        failed = 1;
+        setfailed();
         return -1;
     }
 
-    ssize_t n;
-    int rv = 0;
-
     while ((n = read(fdf, buf, DEFB)) > 0) {
         ssize_t n1 = write(fdt, buf, n);
         if (n1 != n) {
             fprintf(stderr, "cp: error writing %s: %s\n", to, strerror(errno));
-            failed = 1;
+            setfailed();
             rv = -1;
             break;
         }
@@ -181,10 +294,442 @@ int copy1(int fdf, int fdt, char *from, char *to) {
 
     if (n < 0) {
         fprintf(stderr, "cp: error reading %s: %s\n", from, strerror(errno));
-        failed = 1;
+        setfailed();
         rv = -1;
     }
 
     free(buf);
     return rv;
-}
\ No newline at end of file
+
+fail:
+    // either end may be at fault; the kernel doesn't say which
+    fprintf(stderr, "cp: error copying %s to %s: %s\n", from, to, strerror(errno));
+    setfailed();
+    return -1;
+}
+
+// Copy len bytes at off of fdf to the same place in fdt, in the
+// kernel if it can, leaving both files' offsets alone.
+int copyrange(int fdf, int fdt, off_t off, off_t len, char *from, char *to) {
+    off_t offf = off, offt = off, end = off + len;
+    ssize_t n = 0;
+
+    while (offf < end && (n = copy_file_range(fdf, &offf, fdt, &offt, end - offf, 0)) > 0)
+        offt = offf;
+    // as in copy1, 0 with nothing copied means try the next way
+    if (offf >= end || (n == 0 && offf > off))
+        return 0;
+    if (n < 0 && (offf > off || !unsupported(errno))) {
+        fprintf(stderr, "cp: error copying %s to %s: %s\n", from, to, strerror(errno));
+        setfailed();
+        return -1;
+    }
+
+    char *buf = malloc(DEFB);
+    if (buf == NULL) {
+        fprintf(stderr, "cp: memory allocation failed\n");
+        setfailed();
+        return -1;
+    }
+    while (offf < end && (n = pread(fdf, buf, end - offf < DEFB ? end - offf : DEFB, offf)) > 0) {
+        if (pwrite(fdt, buf, n, offf) != n) {
+            fprintf(stderr, "cp: error writing %s: %s\n", to, strerror(errno));
+            setfailed();
+            free(buf);
+            return -1;
+        }
+        offf += n;
+    }
+    free(buf);
+    if (n < 0) {
+        fprintf(stderr, "cp: error reading %s: %s\n", from, strerror(errno));
+        setfailed();
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * cp -r walks the source tree here while a pool of threads copies
+ * the files.  Small files go out in batches, so a worker pays for
+ * the queue's lock once per BATCH of them; a big file that can't be
+ * reflinked is cut into RANGEs, copied side by side, and whoever
+ * finishes its last range sets its metadata.  Directories are made
+ * writable as they are reached, and get their own mode and times
+ * only when every copy is done, deepest first, since filling a
+ * directory changes its times.  Files linked more than once are
+ * copied once and linked again, found by source (dev, ino).
+ */
+pthread_mutex_t qlk = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t qwork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t qroom = PTHREAD_COND_INITIALIZER;
+Job *qhead;
+Job *qtail;
+int nq;
+int qdone;
+
+Dir *dirs;
+int ndirs;
+int maxdirs;
+
+Link *links;
+int nlinks;
+int maxlinks;
+
+dev_t rootdev;       // the copy's top directory, not to be walked into
+ino_t rootino;
+
+void *emalloc(size_t n) {
+    void *p = malloc(n);
+    if (p == NULL) {
+        fprintf(stderr, "cp: memory allocation failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+char *join(char *dir, char *name) {
+    char *s = emalloc(strlen(dir) + strlen(name) + 2);
+    sprintf(s, "%s/%s", dir, name);
+    return s;
+}
+
+void enqueue(Job *j) {
+    pthread_mutex_lock(&qlk);
+    while (nq >= QMAX)
+        pthread_cond_wait(&qroom, &qlk);
+    j->next = NULL;
+    if (qtail)
+        qtail->next = j;
+    else
+        qhead = j;
+    qtail = j;
+    nq++;
+    pthread_cond_signal(&qwork);
+    pthread_mutex_unlock(&qlk);
+}
+
+void freejob(Job *j) {
+    if (j->len < 0 || __atomic_sub_fetch(j->left, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (j->len >= 0) {
+            // the last range of a file: its metadata can go on now
+            setmeta(-1, j->to, &j->st);
+            free(j->left);
+        }
+        free(j->from);
+        free(j->to);
+    }
+    free(j);
+}
+
+void runjob(Job *j) {
+    int fdf = open(j->from, O_RDONLY);
+    if (fdf < 0) {
+        fprintf(stderr, "cp: can't open %s: %s\n", j->from, strerror(errno));
+        setfailed();
+        return;
+    }
+    if (j->len >= 0) {
+        int fdt = open(j->to, O_WRONLY);
+        if (fdt < 0) {
+            fprintf(stderr, "cp: can't open %s: %s\n", j->to, strerror(errno));
+            setfailed();
+        } else {
+            copyrange(fdf, fdt, j->off, j->len, j->from, j->to);
+            close(fdt);
+        }
+        close(fdf);
+        return;
+    }
+    int fdt = open(j->to, O_WRONLY | O_CREAT | O_TRUNC, j->st.st_mode & 0777);
+    if (fdt < 0) {
+        fprintf(stderr, "cp: can't create %s: %s\n", j->to, strerror(errno));
+        setfailed();
+    } else {
+        if (copy1(fdf, fdt, j->from, j->to) == 0)
+            setmeta(fdt, j->to, &j->st);
+        close(fdt);
+    }
+    close(fdf);
+}
+
+void *worker(void *arg) {
+    Job *batch, *last, *j;
+    off_t bytes;
+    int n;
+
+    (void)arg;
+    pthread_mutex_lock(&qlk);
+    for (;;) {
+        while (qhead == NULL && !qdone)
+            pthread_cond_wait(&qwork, &qlk);
+        if (qhead == NULL)
+            break;
+        // many small files, or one range
+        batch = qhead;
+        bytes = 0;
+        for (n = 0, j = qhead; j && n < BATCH && bytes < RANGE; n++, j = j->next) {
+            bytes += j->len >= 0 ? j->len : j->st.st_size;
+            last = j;
+        }
+        qhead = j;
+        last->next = NULL;
+        if (qhead == NULL)
+            qtail = NULL;
+        nq -= n;
+        pthread_cond_broadcast(&qroom);
+        pthread_mutex_unlock(&qlk);
+        while ((j = batch) != NULL) {
+            batch = j->next;
+            runjob(j);
+            freejob(j);
+        }
+        pthread_mutex_lock(&qlk);
+    }
+    pthread_mutex_unlock(&qlk);
+    return NULL;
+}
+
+// The first copy of a multiply-linked file, or NULL after adding to.
+char *linked(struct stat *st, char *to) {
+    int i;
+
+    if (2 * (nlinks + 1) > maxlinks) {
+        Link *old = links;
+        int omax = maxlinks;
+        maxlinks = maxlinks ? 2 * maxlinks : 256;
+        links = calloc(maxlinks, sizeof(Link));
+        if (links == NULL) {
+            fprintf(stderr, "cp: memory allocation failed\n");
+            exit(1);
+        }
+        for (i = 0; i < omax; i++)
+            if (old[i].to) {
+                int h = (old[i].ino * 2654435761u) & (maxlinks - 1);
+                while (links[h].to)
+                    h = (h + 1) & (maxlinks - 1);
+                links[h] = old[i];
+            }
+        free(old);
+    }
+    for (i = (st->st_ino * 2654435761u) & (maxlinks - 1); links[i].to; i = (i + 1) & (maxlinks - 1))
+        if (links[i].ino == st->st_ino && links[i].dev == st->st_dev)
+            return links[i].to;
+    links[i].dev = st->st_dev;
+    links[i].ino = st->st_ino;
+    links[i].to = strdup(to);
+    nlinks++;
+    return NULL;
+}
+
+// Queue the copy of regular file from, which big files need made first.
+void copyfile(char *from, char *to, struct stat *st) {
+    Job *j;
+
+    if (st->st_size >= BIG) {
+        int fdf = open(from, O_RDONLY);
+        if (fdf < 0) {
+            fprintf(stderr, "cp: can't open %s: %s\n", from, strerror(errno));
+            setfailed();
+            goto out;
+        }
+        int fdt = open(to, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 0777);
+        if (fdt < 0) {
+            fprintf(stderr, "cp: can't create %s: %s\n", to, strerror(errno));
+            setfailed();
+            close(fdf);
+            goto out;
+        }
+        if (ioctl(fdt, FICLONE, fdf) == 0) {
+            setmeta(fdt, to, st);
+        } else if (ftruncate(fdt, st->st_size) < 0) {
+            fprintf(stderr, "cp: can't extend %s: %s\n", to, strerror(errno));
+            setfailed();
+        } else {
+            close(fdf);
+            close(fdt);
+            int *left = emalloc(sizeof(int));
+            *left = (st->st_size + RANGE - 1) / RANGE;
+            for (off_t off = 0; off < st->st_size; off += RANGE) {
+                j = emalloc(sizeof(Job));
+                j->from = from;
+                j->to = to;
+                j->st = *st;
+                j->off = off;
+                j->len = st->st_size - off < RANGE ? st->st_size - off : RANGE;
+                j->left = left;
+                enqueue(j);
+            }
+            return;
+        }
+        close(fdf);
+        close(fdt);
+    out:
+        free(from);
+        free(to);
+        return;
+    }
+    j = emalloc(sizeof(Job));
+    j->from = from;
+    j->to = to;
+    j->st = *st;
+    j->off = 0;
+    j->len = -1;
+    j->left = NULL;
+    enqueue(j);
+}
+
+// Make a copy of from, lstat'ed as st, as to; takes both names.
+void walk(char *from, char *to, struct stat *st) {
+    char *first;
+
+    if (S_ISREG(st->st_mode)) {
+        if (st->st_nlink > 1 && (first = linked(st, to)) != NULL) {
+            unlink(to);
+            if (link(first, to) < 0) {
+                fprintf(stderr, "cp: can't link %s: %s\n", to, strerror(errno));
+                setfailed();
+            }
+        } else if (st->st_nlink > 1) {
+            // make it now, so a later link to it finds it
+            int fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 0777);
+            if (fd >= 0)
+                close(fd);
+            copyfile(from, to, st);
+            return;
+        } else {
+            copyfile(from, to, st);
+            return;
+        }
+    } else if (S_ISLNK(st->st_mode)) {
+        char buf[4096];
+        ssize_t n = readlink(from, buf, sizeof buf - 1);
+        if (n < 0) {
+            fprintf(stderr, "cp: can't read link %s: %s\n", from, strerror(errno));
+            setfailed();
+        } else {
+            buf[n] = '\0';
+            unlink(to);
+            if (symlink(buf, to) < 0) {
+                fprintf(stderr, "cp: can't create %s: %s\n", to, strerror(errno));
+                setfailed();
+            } else
+                setmeta(-1, to, st);
+        }
+    } else if (S_ISDIR(st->st_mode)) {
+        struct stat sub;
+        struct dirent *de;
+        DIR *d;
+
+        // writable until its contents are in
+        if (mkdir(to, (st->st_mode & 0777) | 0700) < 0 && errno != EEXIST) {
+            fprintf(stderr, "cp: can't create %s: %s\n", to, strerror(errno));
+            setfailed();
+            goto out;
+        }
+        if (ndirs == maxdirs) {
+            maxdirs = maxdirs ? 2 * maxdirs : 64;
+            dirs = realloc(dirs, maxdirs * sizeof(Dir));
+            if (dirs == NULL) {
+                fprintf(stderr, "cp: memory allocation failed\n");
+                exit(1);
+            }
+        }
+        dirs[ndirs].to = to;
+        dirs[ndirs++].st = *st;
+        if ((d = opendir(from)) == NULL) {
+            fprintf(stderr, "cp: can't open %s: %s\n", from, strerror(errno));
+            setfailed();
+            free(from);
+            return;
+        }
+        while ((de = readdir(d)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            char *f = join(from, de->d_name);
+            if (lstat(f, &sub) < 0) {
+                fprintf(stderr, "cp: can't stat %s: %s\n", f, strerror(errno));
+                setfailed();
+                free(f);
+                continue;
+            }
+            if (sub.st_dev == rootdev && sub.st_ino == rootino) {
+                fprintf(stderr, "cp: %s: not copied into itself\n", f);
+                setfailed();
+                free(f);
+                continue;
+            }
+            walk(f, join(to, de->d_name), &sub);
+        }
+        closedir(d);
+        free(from);
+        return;
+    } else {
+        // fifos and devices are made anew
+        unlink(to);
+        if (mknod(to, st->st_mode, st->st_rdev) < 0) {
+            fprintf(stderr, "cp: can't create %s: %s\n", to, strerror(errno));
+            setfailed();
+        } else
+            setmeta(-1, to, st);
+    }
+out:
+    free(from);
+    free(to);
+}
+
+void copytree(char *from, char *to, struct stat *st) {
+    pthread_t tid[256];
+    struct stat rst;
+    int i, n;
+
+    if (samefile(from, st, to)) {
+        setfailed();
+        return;
+    }
+    n = nproc < 256 ? nproc : 256;
+    qdone = 0;
+    for (i = 0; i < n; i++)
+        if (pthread_create(&tid[i], NULL, worker, NULL) != 0)
+            break;
+    n = i;
+    if (n == 0) {
+        fprintf(stderr, "cp: can't start threads\n");
+        setfailed();
+        return;
+    }
+
+    // the top directory first, so the walk can tell it apart
+    if (mkdir(to, (st->st_mode & 0777) | 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "cp: can't create %s: %s\n", to, strerror(errno));
+        setfailed();
+    } else {
+        if (stat(to, &rst) == 0) {
+            rootdev = rst.st_dev;
+            rootino = rst.st_ino;
+        }
+        walk(strdup(from), strdup(to), st);
+    }
+
+    pthread_mutex_lock(&qlk);
+    qdone = 1;
+    pthread_cond_broadcast(&qwork);
+    pthread_mutex_unlock(&qlk);
+    for (i = 0; i < n; i++)
+        pthread_join(tid[i], NULL);
+
+    // contents are in: directories last, children before parents
+    for (i = ndirs - 1; i >= 0; i--) {
+        setmeta(-1, dirs[i].to, &dirs[i].st);
+        // -x set the mode; otherwise take back the 0700 added for the copy
+        if (!xflag && (dirs[i].st.st_mode & 0700) != 0700)
+            chmod(dirs[i].to, dirs[i].st.st_mode & 0777 & ~cmask);
+        free(dirs[i].to);
+    }
+    ndirs = 0;
+    for (i = 0; i < maxlinks; i++)
+        free(links[i].to);
+    free(links);
+    links = NULL;
+    nlinks = maxlinks = 0;
+}
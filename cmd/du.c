@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,6 +11,14 @@
 #include <math.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
 
 /* Plan 9 compatibility */
 typedef struct Dir {
@@ -20,19 +29,105 @@ typedef struct Dir {
     off_t length;
     dev_t dev;
     ino_t ino;
+    nlink_t nlink;
+    long long mns;    /* mtime and ctime in ns, for the -C cache */
+    long long cns;
     int isdir;
 } Dir;
 
+/* one level of a -j walk; paths are only spelled out when needed */
+typedef struct Walk Walk;
+struct Walk {
+    Walk *up;
+    char *name;
+};
+
 typedef struct String {
     char *s;
     int len;
     int alloc;
 } String;
 
+/* one directory in the -C cache file */
+typedef struct Trec Trec;
+struct Trec {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mns;
+    int64_t cns;
+    int64_t files;
+    uint64_t off;    /* names, in the pool after the table */
+    uint64_t len;
+};
+
+/* with -U, a window of a directory's entries read ahead and stat'ed at once */
+typedef struct Uring Uring;
+typedef struct Ubatch Ubatch;
+struct Ubatch {
+    Uring *u;
+    int fd;
+    String names;
+    unsigned char *type;
+    int *res;
+    struct statx *stx;
+    int n;
+    int i;          /* next entry nextname hands out */
+    char *cur;
+};
+
+/* a directory's entries: from readdir, or replayed from the -C cache */
+typedef struct Dirents {
+    DIR *dirp;
+    Trec *hit;
+    char *next;    /* cached names, each NUL-terminated */
+    char *end;
+    Ubatch *b;
+    double lat;    /* seconds in its stat and readdir calls */
+} Dirents;
+
+/* one line of output, held back by -T */
+typedef struct Line {
+    long long amt;
+    char *name;
+    uint64_t ino;
+    long long mtime;
+    int depth;
+    long seq;
+    long long err;    /* -E: half-width of the 95% interval */
+} Line;
+
+/* bump allocator for names, freed all at once */
+typedef struct Arena Arena;
+struct Arena {
+    Arena *next;
+    size_t n;
+    size_t max;
+    char buf[];
+};
+
+/* --progress counters */
+enum {
+    Nlat = 10,    /* <1µs, <4µs, ... <64ms, and the rest */
+};
+
+typedef struct Instr {
+    long long dirs;
+    long long ents;
+    long long bytes;     /* tallied, before rounding to blocks */
+    long long reads;     /* files handed to the -r readers */
+    long long lat[Nlat];
+    double slowest;
+    char *slowpath;
+} Instr;
+
 extern long long du(char*, Dir*);
+extern long long pdu(char*, Dir*);
 extern void err(char*);
 extern long long blkmultiple(long long);
 extern int seen(Dir*);
+extern int eseen(Dir*);
+extern void epending(int);
+extern int readonce(Dir*);
 extern int warn(char*);
 
 enum {
@@ -46,18 +141,37 @@ enum {
 
 int    aflag;
 int    autoscale;
+int    directflag;
+int    estflag;        /* -E: estimate by sampling */
 int    fflag;
 int    fltflag;
+int    jsonflag;    /* -J: one JSON object per line */
+char    **xpat;        /* -x patterns */
+int    nxpat;
+int    nulflag;     /* -0: tab-separated fields, NUL-terminated */
+int    iflag;        /* count inodes, not bytes */
+int    mflag;        /* -m: stay on the arguments' file systems */
+int    njobs;
+int    progressflag;    /* --progress: rates on stderr */
 int    qflag;
 int    readflg;
 int    sflag;
+int    statsflag;
 int    tflag;
+int    topn;        /* -T: keep only the largest topn lines */
 int    uflag;
+int    uringflag;    /* -U: batch stats through io_uring */
+int    verifyflag;
+int    nverify;        /* --verify mismatches */
 
-char    *fmt = "%llu\t%s\n";
-char    *readbuf;
+char    *fmt = "%llu\t";
 long long    blocksize = Vkilo;    /* actually more likely to be 4K or 8K */
 long long    unit;            /* scale factor for output */
+String    path;            /* the serial walk so far */
+int    depth;            /* of the entries being printed */
+dev_t    rootdev;        /* of the argument being walked, for -m */
+char    *cachefile;        /* -C: directory listings from the last run */
+Instr    instr;
 
 static char *pfxes[] = {    /* SI prefixes for units > 1 */
     "",
@@ -68,22 +182,70 @@ static char *pfxes[] = {    /* SI prefixes for units > 1 */
 };
 
 /* String functions */
-String *s_new(void);
-String *s_copy(char *s);
-void s_append(String *s, char *append);
+void s_grow(String *s, int n);
+void s_reset(String *s, char *str);
+int s_push(String *s, char *elem);
+void s_addname(String *s, char *name);
+void s_pop(String *s, int len);
 char *s_to_c(String *s);
-void s_free(String *s);
+char *arenastrdup(Arena **a, char *s);
+void arenafree(Arena *a);
 
 /* Plan 9 compatibility functions */
 Dir *dirstat(char *path);
+int dirstatat(int dfd, char *name, Dir *d);
+int fdirstat(int fd, char *name, Dir *d);
+void stat2dir(struct stat *st, char *name, Dir *d);
+void walkpath(Walk *w, String *s);
+long long dudir(int fd, Dir *dir);
+void prstats(void);
+void iadd(long long *c, long long n);
+double itime(void);
+double ilat(double t0);
+void islow(Dirents *de, char *path);
+void iinit(void);
+void ifinish(void);
+double enow(void);
+void xcompile(void);
+int excluded(char *name);
+uint64_t xsig(void);
+void printamt(long long amt, char *name, Dir *d);
+void printest(long long amt, long long err, char *name, Dir *d);
+void pramt(long long amt);
+void prline(Line *l);
+void prrecord(Line *l);
+void oflush(void);
+void topadd(Line *l);
+void topflush(void);
+int opendirents(Dirents *de, int fd, Dir *dir, long long *files);
+char *nextname(Dirents *de, int *type);
+char *rawname(Dirents *de, int *type);
+int entstat(Dirents *de, int fd, char *name, Dir *d);
+void ubatch(Dirents *de, int fd);
+void ufill(Dirents *de);
+void ufree(Ubatch *b);
+void uclose(void);
+void closedirents(Dirents *de, int fd);
+void tcload(void);
+Trec *tcget(Dir *d);
+char *tcnames(Trec *r);
+void tcput(Dir *d, Dirents *de, long long files, String *names, char *path);
+void tcsave(void);
 int cistrcmp(char *a, char *b);
 void exits(char *msg);
 void sysfatal(char *fmt, ...);
 char *needsrcquote(int c);
 void quotefmtinstall(void);
+void dutop(char *name);
+void etop(char *name, Dir *d);
+void estbudget(char *s);
 long long dirval(Dir *d, long long size);
-void readfile(char *name);
-long long dufile(char *name, Dir *d);
+void readfile(int dfd, char *name, char *path);
+void rdinit(void);
+void rdfinish(void);
+long long dufile(int dfd, Dir *d);
+long long fileval(Dir *d);
+long long fileamt(Dir *d);
 
 /* Global for quote handling */
 int doquote = 0;
@@ -92,15 +254,55 @@ char *(*needsrcquote_func)(int) = NULL;
 void
 usage(void)
 {
-    fprintf(stderr, "usage: du [-aefhnqstu] [-b size] [-p si-pfx] [file ...]\n");
+    fprintf(stderr, "usage: du [-0adefhimnqrstuJU] [-b size] [-C cache [--verify]] [-E budget[s][,depth]] [-j nproc] [-p si-pfx] [-T n] [-x pattern]... [--progress] [--stats] [file ...]\n");
     exits("usage");
 }
 
 void
-printamt(long long amt, char *name)
+printamt(long long amt, char *name, Dir *d)
+{
+    printest(amt, 0, name, d);
+}
+
+void
+printest(long long amt, long long err, char *name, Dir *d)
 {
+    Line l;
+
     if (readflg)
         return;
+    l.amt = amt;
+    l.err = err;
+    l.name = name;
+    l.ino = d ? d->ino : 0;
+    l.mtime = d ? d->mtime : 0;
+    l.depth = depth;
+    if (topn)
+        topadd(&l);
+    else
+        prline(&l);
+}
+
+void
+prline(Line *l)
+{
+    if (nulflag || jsonflag) {
+        prrecord(l);
+        return;
+    }
+    pramt(l->amt);
+    if (estflag) {
+        fputs("±", stdout);
+        pramt(l->err);
+    }
+    fputs(l->name, stdout);
+    putchar('\n');
+}
+
+/* an amount in the chosen units, and a tab */
+void
+pramt(long long amt)
+{
     if (autoscale) {
         int scale = 0;
         double val = (double)amt/unit;
@@ -109,18 +311,278 @@ printamt(long long amt, char *name)
             scale++;
             val /= 1024;
         }
-        printf("%.6g%s\t%s\n", val, pfxes[scale], name);
+        printf("%.6g%s\t", val, pfxes[scale]);
     } else if (fltflag)
-        printf("%.6g\t%s\n", (double)amt/unit, name);
+        printf("%.6g\t", (double)amt/unit);
     else
-        printf(fmt, HOWMANY(amt, unit), name);
+        printf(fmt, HOWMANY(amt, unit));
+}
+
+/*
+ * -0 and -J records bypass stdio: they are formatted by hand into
+ * one large buffer that is written out whenever it fills.  -0 is
+ * size (and under -E its error), inode, mtime and depth, tab-
+ * separated, then the path and a NUL; a path can hold tabs and
+ * newlines, since it comes last.  -J escapes the path for JSON and
+ * passes UTF-8 through; a path that isn't valid UTF-8 has every
+ * byte >= 0x80 written as \u00XX and the record marked "bytes":true,
+ * so its Latin-1 encoding gives back the name exactly.
+ */
+enum {
+    Obufsize = 1024*1024,
+};
+
+char    obuf[Obufsize];
+int    nobuf;
+
+void
+oflush(void)
+{
+    char *p = obuf;
+    ssize_t n;
+
+    while (nobuf > 0) {
+        n = write(1, p, nobuf);
+        if (n <= 0)
+            sysfatal("write error: %s", strerror(errno));
+        p += n;
+        nobuf -= n;
+    }
+}
+
+void
+oput(char *s, int n)
+{
+    if (nobuf + n > Obufsize)
+        oflush();
+    memcpy(obuf + nobuf, s, n);
+    nobuf += n;
+}
+
+void
+ounum(unsigned long long u, int neg)
+{
+    char buf[24], *p = buf + sizeof buf;
+
+    do
+        *--p = '0' + u%10;
+    while ((u /= 10) != 0);
+    if (neg)
+        *--p = '-';
+    oput(p, buf + sizeof buf - p);
+}
+
+void
+onum(long long v)
+{
+    ounum(v < 0 ? -(unsigned long long)v : (unsigned long long)v, v < 0);
+}
+
+/* is s well-formed UTF-8: no overlongs, surrogates or past U+10FFFF? */
+int
+utf8ok(char *s)
+{
+    unsigned char *p = (unsigned char*)s;
+    unsigned long c;
+    int n, i;
+
+    while (*p) {
+        if (*p < 0x80) {
+            p++;
+            continue;
+        }
+        if (*p >= 0xc2 && *p <= 0xdf)
+            n = 1, c = *p & 0x1f;
+        else if (*p >= 0xe0 && *p <= 0xef)
+            n = 2, c = *p & 0x0f;
+        else if (*p >= 0xf0 && *p <= 0xf4)
+            n = 3, c = *p & 0x07;
+        else
+            return 0;
+        for (i = 1; i <= n; i++) {
+            if ((p[i] & 0xc0) != 0x80)
+                return 0;
+            c = c << 6 | (p[i] & 0x3f);
+        }
+        if ((n == 2 && c < 0x800) || (n == 3 && c < 0x10000)
+        || (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff)
+            return 0;
+        p += n + 1;
+    }
+    return 1;
+}
+
+/* s as a JSON string; raw: bytes >= 0x80 too are \u00XX */
+void
+ojsonstr(char *s, int raw)
+{
+    static char hex[] = "0123456789abcdef";
+    char esc[6] = {'\\', 'u', '0', '0'};
+    char *p;
+
+    oput("\"", 1);
+    for (p = s; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            oput(s, p - s);
+            oput("\\", 1);
+            s = p;
+        } else if ((unsigned char)*p < 0x20 || (raw && (unsigned char)*p >= 0x80)) {
+            oput(s, p - s);
+            esc[4] = hex[(unsigned char)*p >> 4];
+            esc[5] = hex[(unsigned char)*p & 0xf];
+            oput(esc, 6);
+            s = p + 1;
+        }
+    }
+    oput(s, p - s);
+    oput("\"", 1);
+}
+
+void
+prrecord(Line *l)
+{
+    long long amt = HOWMANY(l->amt, unit);
+    int raw;
+
+    if (nulflag) {
+        onum(amt);
+        oput("\t", 1);
+        if (estflag) {
+            onum(HOWMANY(l->err, unit));
+            oput("\t", 1);
+        }
+        ounum(l->ino, 0);
+        oput("\t", 1);
+        onum(l->mtime);
+        oput("\t", 1);
+        onum(l->depth);
+        oput("\t", 1);
+        oput(l->name, strlen(l->name) + 1);
+        return;
+    }
+    oput("{\"size\":", 8);
+    onum(amt);
+    if (estflag) {
+        oput(",\"err\":", 7);
+        onum(HOWMANY(l->err, unit));
+    }
+    oput(",\"ino\":", 7);
+    ounum(l->ino, 0);
+    oput(",\"mtime\":", 9);
+    onum(l->mtime);
+    oput(",\"depth\":", 9);
+    onum(l->depth);
+    raw = !utf8ok(l->name);
+    oput(",\"path\":", 8);
+    ojsonstr(l->name, raw);
+    if (raw)
+        oput(",\"bytes\":true", 13);
+    oput("}\n", 2);
+}
+
+/*
+ * -T keeps the largest topn lines in a min-heap, so only they are
+ * formatted, and only a line that makes the cut copies its name.
+ * Ties go to the line seen first.
+ */
+Line    *top;
+int    ntop;
+long    topseq;
+
+/* does a leave the heap before b? */
+int
+toplt(Line *a, Line *b)
+{
+    if(a->amt != b->amt)
+        return a->amt < b->amt;
+    return a->seq > b->seq;
+}
+
+void
+topdown(int i)
+{
+    Line t;
+    int c;
+
+    for(;;) {
+        c = 2*i + 1;
+        if(c >= ntop)
+            break;
+        if(c+1 < ntop && toplt(&top[c+1], &top[c]))
+            c++;
+        if(!toplt(&top[c], &top[i]))
+            break;
+        t = top[i];
+        top[i] = top[c];
+        top[c] = t;
+        i = c;
+    }
+}
+
+void
+topadd(Line *l)
+{
+    Line t, x;
+    int i;
+
+    t = *l;
+    t.seq = topseq++;
+    if(top == NULL) {
+        top = malloc(topn*sizeof(Line));
+        if(top == NULL)
+            sysfatal("out of memory");
+    }
+    if(ntop == topn) {
+        if(!toplt(&top[0], &t))
+            return;
+        free(top[0].name);
+        t.name = strdup(l->name);
+        top[0] = t;
+        topdown(0);
+        return;
+    }
+    t.name = strdup(l->name);
+    i = ntop++;
+    top[i] = t;
+    while(i > 0 && toplt(&top[i], &top[(i-1)/2])) {
+        x = top[i];
+        top[i] = top[(i-1)/2];
+        top[(i-1)/2] = x;
+        i = (i-1)/2;
+    }
+}
+
+int
+topcmp(const void *va, const void *vb)
+{
+    const Line *a = va, *b = vb;
+
+    if(a->amt != b->amt)
+        return a->amt > b->amt ? -1 : 1;
+    return a->seq < b->seq ? -1 : 1;
+}
+
+/* largest first */
+void
+topflush(void)
+{
+    int i;
+
+    qsort(top, ntop, sizeof(Line), topcmp);
+    for(i = 0; i < ntop; i++) {
+        prline(&top[i]);
+        free(top[i].name);
+    }
+    free(top);
+    top = NULL;
+    ntop = 0;
 }
 
 int
 main(int argc, char *argv[])
 {
     int i, scale;
-    char *s, *ss, *name;
+    char *s, *ss;
     int arg_index = 1;
 
     doquote = 1;  /* Enable quoting by default */
@@ -132,9 +594,27 @@ main(int argc, char *argv[])
             arg_index++;
             break;
         }
+        if (strcmp(arg, "--progress") == 0) {
+            progressflag = 1;
+            arg_index++;
+            continue;
+        }
+        if (strcmp(arg, "--stats") == 0) {
+            statsflag = 1;
+            arg_index++;
+            continue;
+        }
+        if (strcmp(arg, "--verify") == 0) {
+            verifyflag = 1;
+            arg_index++;
+            continue;
+        }
         
         for (i = 1; arg[i]; i++) {
             switch (arg[i]) {
+            case '0':    /* records for programs, NUL-terminated */
+                nulflag = 1;
+                break;
             case 'a':    /* all files */
                 aflag = 1;
                 break;
@@ -155,6 +635,30 @@ main(int argc, char *argv[])
                         blocksize *= 1024;
                 }
                 break;
+            case 'C':    /* reuse listings of unchanged directories */
+                if (arg[i+1]) {
+                    cachefile = &arg[i+1];
+                    i = strlen(arg) - 1;  /* skip to end */
+                } else if (arg_index + 1 < argc) {
+                    cachefile = argv[++arg_index];
+                } else {
+                    usage();
+                }
+                break;
+            case 'd':    /* -r bypasses the page cache */
+                directflag = 1;
+                break;
+            case 'E':    /* estimate within a budget */
+                if (arg[i+1]) {
+                    s = &arg[i+1];
+                    i = strlen(arg) - 1;  /* skip to end */
+                } else if (arg_index + 1 < argc) {
+                    s = argv[++arg_index];
+                } else {
+                    usage();
+                }
+                estbudget(s);
+                break;
             case 'e':    /* print in %g notation */
                 fltflag = 1;
                 break;
@@ -164,6 +668,28 @@ main(int argc, char *argv[])
             case 'h':    /* similar to -h in bsd but more precise */
                 autoscale = 1;
                 break;
+            case 'i':    /* inodes: count entries */
+                iflag = 1;
+                break;
+            case 'J':    /* records for programs, as NDJSON */
+                jsonflag = 1;
+                break;
+            case 'j':    /* parallel traversal */
+                if (arg[i+1]) {
+                    s = &arg[i+1];
+                    i = strlen(arg) - 1;  /* skip to end */
+                } else if (arg_index + 1 < argc) {
+                    s = argv[++arg_index];
+                } else {
+                    usage();
+                }
+                njobs = strtol(s, &ss, 0);
+                if (s == ss || *ss != '\0' || njobs < 1)
+                    usage();
+                break;
+            case 'm':    /* one file system */
+                mflag = 1;
+                break;
             case 'n':    /* all files, number of bytes */
                 aflag = 1;
                 blocksize = 1;
@@ -190,11 +716,10 @@ main(int argc, char *argv[])
                 }
                 break;
             case 'q':    /* qid */
-                fmt = "%llx\t%s\n";
+                fmt = "%llx\t";
                 qflag = 1;
                 break;
-            case 'r':
-                /* undocumented: just read & ignore every block of every file */
+            case 'r':    /* read every block of every file */
                 readflg = 1;
                 break;
             case 's':    /* only top level */
@@ -203,18 +728,55 @@ main(int argc, char *argv[])
             case 't':    /* return modified/accessed time */
                 tflag = 1;
                 break;
+            case 'T':    /* only the largest n */
+                if (arg[i+1]) {
+                    s = &arg[i+1];
+                    i = strlen(arg) - 1;  /* skip to end */
+                } else if (arg_index + 1 < argc) {
+                    s = argv[++arg_index];
+                } else {
+                    usage();
+                }
+                topn = strtol(s, &ss, 0);
+                if (s == ss || *ss != '\0' || topn < 1)
+                    usage();
+                break;
             case 'u':    /* accessed time */
                 uflag = 1;
                 break;
+            case 'U':    /* stat a directory at a time with io_uring */
+                uringflag = 1;
+                break;
+            case 'x':    /* prune matching names */
+                if (arg[i+1]) {
+                    s = &arg[i+1];
+                    i = strlen(arg) - 1;  /* skip to end */
+                } else if (arg_index + 1 < argc) {
+                    s = argv[++arg_index];
+                } else {
+                    usage();
+                }
+                xpat = realloc(xpat, (nxpat+1)*sizeof(char*));
+                if (xpat == NULL)
+                    sysfatal("out of memory");
+                xpat[nxpat++] = s;
+                break;
             default:
                 usage();
             }
         }
         arg_index++;
     }
+    xcompile();
 
+    if (nulflag && jsonflag)
+        usage();
+    if (estflag && (aflag || qflag || tflag || readflg || cachefile))
+        sysfatal("-E can't be used with -a, -q, -t, -r or -C");
+    if (iflag && (qflag || tflag || readflg || cachefile))
+        sysfatal("-i can't be used with -q, -t, -r or -C");
     if (unit == 0) {
-        if (qflag || tflag || uflag || autoscale)
+        if (iflag || qflag || tflag || uflag || autoscale)
             unit = 1;
         else
             unit = Vkilo;
@@ -222,20 +784,51 @@ main(int argc, char *argv[])
     if (blocksize < 1)
         blocksize = 1;
 
-    if (readflg) {
-        readbuf = malloc(blocksize);
-        if (readbuf == NULL)
-            sysfatal("out of memory");
+    if (directflag && !readflg)
+        usage();
+    if (readflg)
+        rdinit();
+    if (verifyflag && cachefile == NULL)
+        usage();
+    if (cachefile) {
+        if (aflag || readflg)
+            sysfatal("-C can't be used with -a or -r");
+        tcload();
     }
-    
+    if (progressflag)
+        iinit();
+
     if(arg_index >= argc)
-        printamt(du(".", dirstat(".")), ".");
+        dutop(".");
     else
-        for(i = arg_index; i < argc; i++) {
-            name = argv[i];
-            printamt(du(name, dirstat(name)), name);
-        }
-    exits(NULL);
+        for(i = arg_index; i < argc; i++)
+            dutop(argv[i]);
+    if(topn)
+        topflush();
+    if(progressflag)
+        ifinish();
+    if(readflg)
+        rdfinish();
+    if(cachefile)
+        tcsave();
+    if(statsflag)
+        prstats();
+    exits(nverify ? "verify" : NULL);
+}
+
+void
+dutop(char *name)
+{
+    Dir *d = dirstat(name);
+
+    depth = 0;
+    if(estflag) {
+        etop(name, d);
+        free(d);
+        return;
+    }
+    printamt((njobs > 1 ? pdu : du)(name, d), name, d);
+    free(d);
 }
 
 long long
@@ -251,37 +844,178 @@ dirval(Dir *d, long long size)
         return size;
 }
 
+/*
+ * -r reads every file, to warm the cache or to scrub the media;
+ * with -d it uses O_DIRECT so the page cache is left alone.  The
+ * walk opens each file and queues it, and a pool of readers keeps
+ * that many files in flight: njobs with -j, else Nreaders.
+ */
+enum {
+    Nreaders = 8,
+    Readsize = 1024*1024,    /* a multiple of any O_DIRECT alignment */
+    Rqsize = 64,
+};
+
+typedef struct Rjob {
+    int fd;
+    char *path;    /* for warnings */
+} Rjob;
+
+Rjob    rq[Rqsize];
+int    rqhead;
+int    rqn;
+int    rqclosed;
+pthread_mutex_t rqlk = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t rqput = PTHREAD_COND_INITIALIZER;
+pthread_cond_t rqget = PTHREAD_COND_INITIALIZER;
+pthread_t    *readers;
+int    nreaders;
+long long    rdbytes;
+long long    rdfiles;
+struct timespec    rdstart;
+
+void *
+reader(void *arg)
+{
+    Rjob j;
+    char *buf;
+    ssize_t n;
+    long long tot;
+
+    (void)arg;
+    if(posix_memalign((void**)&buf, 4096, Readsize) != 0)
+        sysfatal("out of memory");
+    for(;;) {
+        pthread_mutex_lock(&rqlk);
+        while(rqn == 0 && !rqclosed)
+            pthread_cond_wait(&rqput, &rqlk);
+        if(rqn == 0) {
+            pthread_mutex_unlock(&rqlk);
+            break;
+        }
+        j = rq[rqhead];
+        rqhead = (rqhead+1) % Rqsize;
+        rqn--;
+        pthread_cond_signal(&rqget);
+        pthread_mutex_unlock(&rqlk);
+
+        tot = 0;
+        while((n = read(j.fd, buf, Readsize)) > 0)
+            tot += n;
+        if(n < 0)
+            warn(j.path);
+        close(j.fd);
+        free(j.path);
+        __atomic_add_fetch(&rdbytes, tot, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&rdfiles, 1, __ATOMIC_RELAXED);
+    }
+    free(buf);
+    return NULL;
+}
+
 void
-readfile(char *name)
+rdinit(void)
 {
-    int n, fd = open(name, O_RDONLY);
+    int i;
 
-    if(fd < 0) {
-        warn(name);
-        return;
+    nreaders = njobs > 1 ? njobs : Nreaders;
+    readers = malloc(nreaders*sizeof(pthread_t));
+    if(readers == NULL)
+        sysfatal("out of memory");
+    clock_gettime(CLOCK_MONOTONIC, &rdstart);
+    for(i = 0; i < nreaders; i++)
+        if(pthread_create(&readers[i], NULL, reader, NULL) != 0)
+            sysfatal("can't create thread: %s", strerror(errno));
+}
+
+/* path is only for warnings */
+void
+readfile(int dfd, char *name, char *path)
+{
+    int fd = -1;
+
+    if(directflag) {
+        fd = openat(dfd, name, O_RDONLY|O_NOFOLLOW|O_DIRECT);
+        if(fd < 0 && errno != EINVAL)    /* EINVAL: fs can't do it */
+            goto bad;
     }
-    while ((n = read(fd, readbuf, blocksize)) > 0)
-        continue;
-    if (n < 0)
-        warn(name);
-    close(fd);
+    if(fd < 0)
+        fd = openat(dfd, name, O_RDONLY|O_NOFOLLOW);
+    if(fd < 0)
+        goto bad;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    iadd(&instr.reads, 1);
+
+    pthread_mutex_lock(&rqlk);
+    while(rqn == Rqsize)
+        pthread_cond_wait(&rqget, &rqlk);
+    rq[(rqhead+rqn) % Rqsize].fd = fd;
+    rq[(rqhead+rqn) % Rqsize].path = strdup(path);
+    rqn++;
+    pthread_cond_signal(&rqput);
+    pthread_mutex_unlock(&rqlk);
+    return;
+
+bad:
+    warn(path);
+}
+
+/* wait for the readers and report the rate */
+void
+rdfinish(void)
+{
+    struct timespec now;
+    double secs;
+    int i;
+
+    pthread_mutex_lock(&rqlk);
+    rqclosed = 1;
+    pthread_cond_broadcast(&rqput);
+    pthread_mutex_unlock(&rqlk);
+    for(i = 0; i < nreaders; i++)
+        pthread_join(readers[i], NULL);
+    free(readers);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - rdstart.tv_sec) + (now.tv_nsec - rdstart.tv_nsec) / 1e9;
+    if(secs <= 0)
+        secs = 1e-9;
+    fprintf(stderr, "du: read %lld files, %.1f MB in %.2fs: %.1f MB/s, %.1f files/s\n",
+        rdfiles, rdbytes / 1e6, secs, rdbytes / 1e6 / secs, rdfiles / secs);
 }
 
+/* a file's size, or with -i its count */
 long long
-dufile(char *name, Dir *d)
+fileamt(Dir *d)
 {
-    long long t = blkmultiple(d->length);
+    if(iflag)
+        return 1;
+    return blkmultiple(d->length);
+}
 
-    if(aflag || readflg) {
-        String *file = s_copy(name);
+/* what a plain file contributes to its directory's total */
+long long
+fileval(Dir *d)
+{
+    long long t = fileamt(d);
+
+    if(aflag || readflg)
+        t = dirval(d, t);
+    return t;
+}
+
+/* d has already been pushed onto path */
+long long
+dufile(int dfd, Dir *d)
+{
+    long long t = fileamt(d);
 
-        s_append(file, "/");
-        s_append(file, d->name);
-        if (readflg)
-            readfile(s_to_c(file));
+    iadd(&instr.bytes, d->length);
+    if(aflag || readflg) {
+        if (readflg && S_ISREG(d->mode))
+            readfile(dfd, d->name, s_to_c(&path));
         t = dirval(d, t);
-        printamt(t, s_to_c(file));
-        s_free(file);
+        printamt(t, s_to_c(&path), d);
     }
     return t;
 }
@@ -289,99 +1023,1844 @@ dufile(char *name, Dir *d)
 long long
 du(char *name, Dir *dir)
 {
-    DIR *dirp;
-    struct dirent *entry;
-    String *file;
-    long long nk, t;
-    Dir *d;
+    int fd;
 
     if(dir == NULL)
         return warn(name);
 
     if(!dir->isdir)
-        return dirval(dir, blkmultiple(dir->length));
+        return dirval(dir, fileamt(dir));
 
-    dirp = opendir(name);
-    if(dirp == NULL)
+    fd = open(name, O_RDONLY|O_DIRECTORY);
+    if(fd < 0)
         return warn(name);
-    
-    nk = 0;
-    while((entry = readdir(dirp)) != NULL) {
-        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+    rootdev = dir->dev;
+    s_reset(&path, name);
+    return dudir(fd, dir);
+}
 
-        file = s_copy(name);
-        s_append(file, "/");
-        s_append(file, entry->d_name);
-        
-        d = dirstat(s_to_c(file));
-        if(d == NULL) {
-            s_free(file);
-            continue;
-        }
+/*
+ * Walk the directory open on fd, which dudir owns.  Entries are
+ * looked up relative to it, so the kernel never re-resolves the
+ * leading path components.
+ */
+long long
+dudir(int fd, Dir *dir)
+{
+    Dirents de;
+    String names = {NULL, 0, 0};
+    char *name;
+    long long nk, t, own;
+    Dir d;
+    int sfd, mark, type;
+
+    if(opendirents(&de, fd, dir, &nk) < 0) {
+        close(fd);
+        return warn(s_to_c(&path));
+    }
 
-        if(!d->isdir) {
-            nk += dufile(name, d);
-            free(d);
-            s_free(file);
+    iadd(&instr.dirs, 1);
+    own = 0;
+    depth++;
+    while((name = nextname(&de, &type)) != NULL) {
+        iadd(&instr.ents, 1);
+        sfd = -1;
+        if(iflag && type != DT_UNKNOWN && type != DT_DIR) {
+            /* -i: the type from readdir is all we need */
+            nk++;
+            if(aflag) {
+                mark = s_push(&path, name);
+                printamt(1, s_to_c(&path), NULL);
+                s_pop(&path, mark);
+            }
             continue;
         }
-
-        if(seen(d)) {
-            free(d);
-            s_free(file);
-            continue;    /* don't get stuck */
+        /* d.name borrows name, which outlives this iteration */
+        if(iflag && type == DT_DIR) {
+            /* stat the directory through the fd we need anyway */
+            sfd = openat(fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+            if(sfd >= 0 && fdirstat(sfd, name, &d) < 0) {
+                close(sfd);
+                sfd = -1;
+            }
+        }
+        if(sfd < 0 && entstat(&de, fd, name, &d) < 0)
+            continue;
+        if(mflag && d.dev != rootdev) {
+            /* a mount point: its own stat is as far as we go */
+            if(sfd >= 0)
+                close(sfd);
+            continue;
+        }
+        mark = s_push(&path, d.name);
+
+        if(cachefile && de.hit == NULL) {
+            if(d.isdir || d.nlink > 1)
+                s_addname(&names, d.name);
+            else
+                own += fileval(&d);
+        }
+
+        if(!d.isdir) {
+            if(iflag || d.nlink <= 1 || !seen(&d))    /* count hard links once */
+                nk += dufile(fd, &d);
+            s_pop(&path, mark);
+            continue;
+        }
+
+        if(seen(&d)) {
+            if(sfd >= 0)
+                close(sfd);
+            s_pop(&path, mark);
+            continue;    /* don't get stuck */
+        }
+
+        if(sfd < 0)
+            sfd = openat(fd, d.name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+        if(sfd < 0)
+            t = warn(s_to_c(&path));
+        else
+            t = dudir(sfd, &d);
+
+        nk += t;
+        t = dirval(&d, t);
+        if(!sflag)
+            printamt(t, s_to_c(&path), &d);
+        s_pop(&path, mark);
+    }
+    depth--;
+    if(cachefile)
+        tcput(dir, &de, own, &names, s_to_c(&path));
+    free(names.s);
+    islow(&de, s_to_c(&path));
+    closedirents(&de, fd);
+    if(iflag)
+        nk++;    /* the directory itself */
+    return dirval(dir, nk);
+}
+
+int
+opendirents(Dirents *de, int fd, Dir *dir, long long *files)
+{
+    de->dirp = NULL;
+    de->b = NULL;
+    de->lat = 0;
+    de->hit = tcget(dir);
+    if(de->hit != NULL) {
+        de->next = tcnames(de->hit);
+        de->end = de->next + de->hit->len;
+        *files = de->hit->files;
+    } else {
+        *files = 0;
+        de->dirp = fdopendir(fd);
+        if(de->dirp == NULL)
+            return -1;
+    }
+    if(uringflag)
+        ubatch(de, fd);
+    return 0;
+}
+
+char *
+nextname(Dirents *de, int *type)
+{
+    Ubatch *b = de->b;
+    char *name;
+
+    if(b == NULL)
+        return rawname(de, type);
+    if(b->i == b->n) {
+        ufill(de);
+        if(b->n == 0)
+            return NULL;
+    }
+    name = b->cur;
+    b->cur += strlen(name) + 1;
+    *type = b->type[b->i++];
+    return name;
+}
+
+char *
+rawname(Dirents *de, int *type)
+{
+    struct dirent *entry;
+    char *name;
+    double t0;
+
+    *type = DT_UNKNOWN;
+    if(de->dirp == NULL) {
+        do {
+            if(de->next >= de->end)
+                return NULL;
+            name = de->next;
+            de->next += strlen(name) + 1;
+        } while(excluded(name));
+        return name;
+    }
+    for(;;) {
+        t0 = itime();
+        entry = readdir(de->dirp);
+        de->lat += ilat(t0);
+        if(entry == NULL)
+            return NULL;
+        if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0
+        && !excluded(entry->d_name)) {
+            *type = entry->d_type;
+            return entry->d_name;
+        }
+    }
+}
+
+/* also closes fd */
+void
+closedirents(Dirents *de, int fd)
+{
+    if(de->b != NULL)
+        ufree(de->b);
+    if(de->dirp != NULL)
+        closedir(de->dirp);
+    else
+        close(fd);
+}
+
+/*
+ * -U: read a directory's names ahead, Uringsize at a time, and stat
+ * each window with one io_uring submission of IORING_OP_STATX, so
+ * latency is paid per window rather than per entry, and memory
+ * stays the same for a directory of any size.  Each thread has its own ring;
+ * where io_uring is missing, and for any entry whose statx fails,
+ * entstat falls back to fstatat.
+ */
+enum {
+    Uringsize = 256,
+    Upending = 1,    /* res of an entry that wasn't submitted */
+};
+
+struct Uring {
+    int fd;
+    unsigned entries;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqmap, *cqmap;
+    size_t sqlen, cqlen, sqeslen;
+};
+
+__thread Uring *uring;
+__thread int uringbroken;
+
+Uring *
+uopen(void)
+{
+    struct io_uring_params p;
+    Uring *u;
+    int fd;
+
+    if(uring != NULL || uringbroken)
+        return uring;
+    memset(&p, 0, sizeof p);
+    fd = syscall(__NR_io_uring_setup, Uringsize, &p);
+    if(fd < 0) {
+        uringbroken = 1;
+        return NULL;
+    }
+    u = calloc(1, sizeof(Uring));
+    if(u == NULL)
+        sysfatal("out of memory");
+    u->fd = fd;
+    u->entries = p.sq_entries;
+    u->sqlen = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    u->cqlen = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(u->cqlen > u->sqlen)
+            u->sqlen = u->cqlen;
+        u->cqlen = u->sqlen;
+    }
+    u->sqeslen = p.sq_entries*sizeof(struct io_uring_sqe);
+    u->sqmap = mmap(NULL, u->sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(u->sqmap == MAP_FAILED)
+        goto bad;
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        u->cqmap = u->sqmap;
+    else {
+        u->cqmap = mmap(NULL, u->cqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(u->cqmap == MAP_FAILED) {
+            munmap(u->sqmap, u->sqlen);
+            goto bad;
+        }
+    }
+    u->sqes = mmap(NULL, u->sqeslen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED) {
+        munmap(u->sqmap, u->sqlen);
+        if(u->cqmap != u->sqmap)
+            munmap(u->cqmap, u->cqlen);
+        goto bad;
+    }
+    u->sqhead = (unsigned*)((char*)u->sqmap + p.sq_off.head);
+    u->sqtail = (unsigned*)((char*)u->sqmap + p.sq_off.tail);
+    u->sqmask = (unsigned*)((char*)u->sqmap + p.sq_off.ring_mask);
+    u->sqarray = (unsigned*)((char*)u->sqmap + p.sq_off.array);
+    u->cqhead = (unsigned*)((char*)u->cqmap + p.cq_off.head);
+    u->cqtail = (unsigned*)((char*)u->cqmap + p.cq_off.tail);
+    u->cqmask = (unsigned*)((char*)u->cqmap + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)((char*)u->cqmap + p.cq_off.cqes);
+    uring = u;
+    return u;
+
+bad:
+    close(fd);
+    free(u);
+    uringbroken = 1;
+    return NULL;
+}
+
+void
+uclose(void)
+{
+    Uring *u = uring;
+
+    if(u == NULL)
+        return;
+    munmap(u->sqes, u->sqeslen);
+    if(u->cqmap != u->sqmap)
+        munmap(u->cqmap, u->cqlen);
+    munmap(u->sqmap, u->sqlen);
+    close(u->fd);
+    free(u);
+    uring = NULL;
+}
+
+unsigned
+ustatxmask(void)
+{
+    unsigned mask = STATX_TYPE|STATX_MODE|STATX_INO|STATX_SIZE|STATX_BLOCKS|STATX_NLINK;
+
+    if(tflag || cachefile)
+        mask |= STATX_MTIME|STATX_CTIME;
+    if(nulflag || jsonflag)
+        mask |= STATX_MTIME;
+    if(uflag)
+        mask |= STATX_ATIME;
+    return mask;
+}
+
+/*
+ * Stat every name in b relative to fd.  queued counts entries in the
+ * ring the kernel hasn't taken yet, inflight those it has and hasn't
+ * finished; an entry left Upending is stat'ed by entstat instead.
+ */
+void
+usubmit(Uring *u, int fd, Ubatch *b)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned tail, head, mask;
+    char *name;
+    int i, inflight, queued, r, intr;
+
+    mask = ustatxmask();
+    name = b->names.s;
+    i = inflight = queued = 0;
+    tail = *u->sqtail;
+    while(i < b->n || queued > 0 || inflight > 0) {
+        for(; i < b->n && inflight+queued < (int)u->entries; i++, name += strlen(name)+1) {
+            /* -i has no use for a stat of a known non-directory */
+            if(iflag && b->type[i] != DT_UNKNOWN && b->type[i] != DT_DIR) {
+                b->res[i] = Upending;
+                continue;
+            }
+            sqe = &u->sqes[tail & *u->sqmask];
+            memset(sqe, 0, sizeof *sqe);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t)name;
+            sqe->len = mask;
+            sqe->off = (uintptr_t)&b->stx[i];
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            sqe->user_data = i;
+            u->sqarray[tail & *u->sqmask] = tail & *u->sqmask;
+            b->res[i] = Upending;
+            tail++;
+            queued++;
+        }
+        __atomic_store_n(u->sqtail, tail, __ATOMIC_RELEASE);
+        if(inflight+queued == 0)
+            break;
+
+        /* r is how many of queued the kernel took, which may be fewer */
+        r = syscall(__NR_io_uring_enter, u->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        intr = 0;
+        if(r < 0) {
+            if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                sysfatal("io_uring_enter: %s", strerror(errno));
+            intr = errno == EINTR;
+            r = 0;
+        }
+        queued -= r;
+        inflight += r;
+        if(queued > 0 && r == 0 && inflight == 0 && !intr) {
+            /* it takes none and has none to finish: take them back */
+            tail = __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE);
+            __atomic_store_n(u->sqtail, tail, __ATOMIC_RELEASE);
+            queued = 0;
+            for(; i < b->n; i++)
+                b->res[i] = Upending;
+        }
+
+        head = *u->cqhead;
+        while(head != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+            cqe = &u->cqes[head & *u->cqmask];
+            b->res[cqe->user_data] = cqe->res;
+            head++;
+            inflight--;
+        }
+        __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+    }
+}
+
+void
+ubatch(Dirents *de, int fd)
+{
+    Uring *u;
+    Ubatch *b;
+
+    if((u = uopen()) == NULL)
+        return;
+    b = calloc(1, sizeof(Ubatch));
+    if(b == NULL)
+        sysfatal("out of memory");
+    b->u = u;
+    b->fd = fd;
+    b->type = malloc(Uringsize);
+    b->res = malloc(Uringsize*sizeof(int));
+    b->stx = malloc(Uringsize*sizeof(struct statx));
+    if(b->type == NULL || b->res == NULL || b->stx == NULL)
+        sysfatal("out of memory");
+    de->b = b;
+}
+
+/* read the next window of names and stat them; none left leaves n 0 */
+void
+ufill(Dirents *de)
+{
+    Ubatch *b = de->b;
+    char *name;
+    double t0;
+    int type;
+
+    b->n = b->i = 0;
+    b->names.len = 0;
+    while(b->n < Uringsize && (name = rawname(de, &type)) != NULL) {
+        s_addname(&b->names, name);
+        b->type[b->n++] = type;
+    }
+    if(b->n > 0) {
+        t0 = itime();
+        usubmit(b->u, b->fd, b);
+        de->lat += ilat(t0);
+    }
+    b->cur = b->names.s;
+}
+
+void
+ufree(Ubatch *b)
+{
+    free(b->names.s);
+    free(b->type);
+    free(b->res);
+    free(b->stx);
+    free(b);
+}
+
+/* the stat of the entry nextname just returned */
+int
+entstat(Dirents *de, int fd, char *name, Dir *d)
+{
+    struct statx *x;
+    Ubatch *b = de->b;
+    double t0;
+    int r;
+
+    if(b == NULL || b->res[b->i-1] != 0) {
+        t0 = itime();
+        r = dirstatat(fd, name, d);
+        de->lat += ilat(t0);
+        return r;
+    }
+    x = &b->stx[b->i-1];
+    memset(d, 0, sizeof *d);
+    d->name = name;
+    d->mode = x->stx_mode;
+    d->length = x->stx_size;
+    d->dev = makedev(x->stx_dev_major, x->stx_dev_minor);
+    d->ino = x->stx_ino;
+    d->nlink = x->stx_nlink;
+    if(x->stx_mask & STATX_MTIME) {
+        d->mtime = x->stx_mtime.tv_sec;
+        d->mns = x->stx_mtime.tv_sec*1000000000LL + x->stx_mtime.tv_nsec;
+    }
+    if(x->stx_mask & STATX_CTIME)
+        d->cns = x->stx_ctime.tv_sec*1000000000LL + x->stx_ctime.tv_nsec;
+    if(x->stx_mask & STATX_ATIME)
+        d->atime = x->stx_atime.tv_sec;
+    d->isdir = S_ISDIR(x->stx_mode);
+    return 0;
+}
+
+/*
+ * Parallel traversal (-j).  Each worker owns a deque of directories
+ * per device: it pushes and pops at the bottom, so it walks depth-first
+ * like du(), and idle workers steal from the top of someone else's.
+ * Workers are dealt out over the devices seen so far and look at
+ * their own device's deques first, so a tree spanning several disks
+ * keeps each of them busy rather than draining one at a time.  The
+ * workers only collect entries; once the pool drains, pwalk() replays
+ * the tree in readdir order, applying seen() and printamt() exactly
+ * as the serial du() would, so the output is identical.
+ */
+typedef struct Pnode Pnode;
+typedef struct Pent Pent;
+
+struct Pent {
+    Dir d;        /* d.name is the bare entry name */
+    Pnode *sub;   /* scanned subdirectory; NULL if it closes a cycle */
+};
+
+struct Pnode {
+    Pnode *parent;
+    Walk w;
+    Dir d;
+    Pent *ent;
+    int nent;
+    int maxent;
+    Arena *names;       /* storage for the ent names */
+    long long files;    /* total of files not kept in ent */
+};
+
+typedef struct Deque {
+    pthread_mutex_t lk;
+    Pnode **q;
+    long top;    /* thieves take from here */
+    long bot;    /* the owner pushes and pops here */
+    long max;
+} Deque;
+
+/* the deques for one device */
+typedef struct Pdev {
+    dev_t dev;
+    Deque *dq;    /* one per worker */
+} Pdev;
+
+enum {
+    Maxdev = 64,    /* beyond this, devices share the last slot */
+};
+
+Pdev pdevs[Maxdev];
+int npdev;
+pthread_mutex_t pdevlk = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t plk = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pcond = PTHREAD_COND_INITIALIZER;
+long pqueued;     /* nodes sitting in some deque */
+long ppending;    /* nodes queued or being scanned */
+
+Pnode *
+pnewnode(Pnode *parent, Dir *d)
+{
+    Pnode *p = calloc(1, sizeof(Pnode));
+
+    if(p == NULL)
+        sysfatal("out of memory");
+    p->parent = parent;
+    p->w.up = &parent->w;
+    p->w.name = d->name;
+    p->d = *d;
+    return p;
+}
+
+/* the slot for dev, added if it's new */
+int
+pdev(dev_t dev)
+{
+    int i, j;
+
+    pthread_mutex_lock(&pdevlk);
+    for(i = 0; i < npdev; i++)
+        if(pdevs[i].dev == dev)
+            break;
+    if(i == npdev) {
+        if(npdev == Maxdev)
+            i = Maxdev-1;
+        else {
+            pdevs[i].dev = dev;
+            pdevs[i].dq = calloc(njobs, sizeof(Deque));
+            if(pdevs[i].dq == NULL)
+                sysfatal("out of memory");
+            for(j = 0; j < njobs; j++)
+                pthread_mutex_init(&pdevs[i].dq[j].lk, NULL);
+            npdev++;
+        }
+    }
+    pthread_mutex_unlock(&pdevlk);
+    return i;
+}
+
+void
+ppush(int self, Pnode *p)
+{
+    Deque *dq = &pdevs[pdev(p->d.dev)].dq[self];
+
+    pthread_mutex_lock(&dq->lk);
+    if(dq->bot == dq->max) {
+        if(dq->top > 0) {
+            memmove(dq->q, dq->q+dq->top, (dq->bot-dq->top)*sizeof(Pnode*));
+            dq->bot -= dq->top;
+            dq->top = 0;
+        }
+        if(dq->bot == dq->max) {
+            dq->max = dq->max ? dq->max*2 : 64;
+            dq->q = realloc(dq->q, dq->max*sizeof(Pnode*));
+            if(dq->q == NULL)
+                sysfatal("out of memory");
+        }
+    }
+    dq->q[dq->bot++] = p;
+    pthread_mutex_unlock(&dq->lk);
+
+    pthread_mutex_lock(&plk);
+    pqueued++;
+    ppending++;
+    pthread_cond_signal(&pcond);
+    pthread_mutex_unlock(&plk);
+}
+
+Pnode *
+ptake(int self)
+{
+    Deque *dq;
+    Pnode *p = NULL;
+    int i, k, n, home;
+
+    pthread_mutex_lock(&pdevlk);
+    n = npdev;
+    pthread_mutex_unlock(&pdevlk);
+    home = self % n;
+
+    dq = &pdevs[home].dq[self];
+    pthread_mutex_lock(&dq->lk);
+    if(dq->bot > dq->top)
+        p = dq->q[--dq->bot];
+    if(dq->bot == dq->top)
+        dq->top = dq->bot = 0;
+    pthread_mutex_unlock(&dq->lk);
+
+    /* steal on our own device, then on the others */
+    for(k = 0; p == NULL && k < n; k++)
+        for(i = k == 0; p == NULL && i < njobs; i++) {
+            dq = &pdevs[(home+k) % n].dq[(self+i) % njobs];
+            pthread_mutex_lock(&dq->lk);
+            if(dq->bot > dq->top)
+                p = dq->q[dq->top++];
+            if(dq->bot == dq->top)
+                dq->top = dq->bot = 0;
+            pthread_mutex_unlock(&dq->lk);
+        }
+    if(p != NULL) {
+        pthread_mutex_lock(&plk);
+        pqueued--;
+        pthread_mutex_unlock(&plk);
+    }
+    return p;
+}
+/*
+ * Does d repeat a directory between p and the top-level argument?
+ * The argument itself is not in seen() during a serial run, so it
+ * is left out here too: du() goes one level further in that case.
+ */
+int
+pcycle(Pnode *p, Dir *d)
+{
+    for(; p != NULL && p->parent != NULL; p = p->parent)
+        if(p->d.ino == d->ino && p->d.dev == d->dev)
+            return 1;
+    return 0;
+}
+
+void
+pscan(int self, Pnode *p, String *wpath)
+{
+    Dirents de;
+    String names = {NULL, 0, 0};
+    char *name;
+    Pent *pe;
+    Dir d;
+    int i, dfd, mark, type;
+
+    /* the parent's fd is long gone; one lookup per directory */
+    walkpath(&p->w, wpath);
+    dfd = open(s_to_c(wpath), O_RDONLY|O_DIRECTORY);
+    if(dfd < 0 || opendirents(&de, dfd, &p->d, &p->files) < 0) {
+        warn(s_to_c(wpath));
+        if(dfd >= 0)
+            close(dfd);
+        return;
+    }
+
+    iadd(&instr.dirs, 1);
+    while((name = nextname(&de, &type)) != NULL) {
+        iadd(&instr.ents, 1);
+        if(iflag && type != DT_UNKNOWN && type != DT_DIR) {
+            /* -i: no stat, and nothing to check in pwalk */
+            memset(&d, 0, sizeof d);
+            d.name = name;
+            d.nlink = 1;
+        } else if(entstat(&de, dfd, name, &d) < 0)
+            continue;
+        else if(mflag && d.dev != rootdev)
+            continue;
+        if(!d.isdir)
+            iadd(&instr.bytes, d.length);
+
+        /* a file with several links is read once, as in the serial walk */
+        if(readflg && S_ISREG(d.mode) && (iflag || d.nlink <= 1 || readonce(&d))) {
+            mark = s_push(wpath, d.name);
+            readfile(dfd, d.name, s_to_c(wpath));
+            s_pop(wpath, mark);
+        }
+        /* files with several links are settled in pwalk, in order */
+        if(!d.isdir && !aflag && (iflag || d.nlink <= 1)) {
+            p->files += fileval(&d);
+            continue;
+        }
+
+        if(p->nent == p->maxent) {
+            p->maxent = p->maxent ? p->maxent*2 : 16;
+            p->ent = realloc(p->ent, p->maxent*sizeof(Pent));
+            if(p->ent == NULL)
+                sysfatal("out of memory");
+        }
+        pe = &p->ent[p->nent++];
+        pe->d = d;
+        pe->d.name = arenastrdup(&p->names, d.name);
+        pe->sub = NULL;
+
+        if(pe->d.isdir && !pcycle(p, &pe->d)) {
+            pe->sub = pnewnode(p, &pe->d);
+            ppush(self, pe->sub);
+        }
+    }
+    /* without -a, ent holds exactly what the cache needs to list */
+    if(cachefile) {
+        if(de.hit == NULL)
+            for(i = 0; i < p->nent; i++)
+                s_addname(&names, p->ent[i].d.name);
+        tcput(&p->d, &de, p->files, &names, s_to_c(wpath));
+        free(names.s);
+    }
+    islow(&de, s_to_c(wpath));
+    closedirents(&de, dfd);
+}
+
+void *
+pworker(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    String wpath = {NULL, 0, 0};
+    Pnode *p;
+
+    for(;;) {
+        if((p = ptake(self)) != NULL) {
+            pscan(self, p, &wpath);
+            pthread_mutex_lock(&plk);
+            if(--ppending == 0)
+                pthread_cond_broadcast(&pcond);
+            pthread_mutex_unlock(&plk);
+            continue;
+        }
+        pthread_mutex_lock(&plk);
+        while(ppending > 0 && pqueued == 0)
+            pthread_cond_wait(&pcond, &plk);
+        if(ppending == 0) {
+            pthread_mutex_unlock(&plk);
+            free(wpath.s);
+            uclose();
+            return NULL;
+        }
+        pthread_mutex_unlock(&plk);
+    }
+}
+
+/* replay a scanned tree in serial order, freeing it as we go */
+long long
+pwalk(Pnode *p)
+{
+    Pent *pe;
+    long long nk, t;
+    int i, mark;
+
+    nk = p->files;
+    depth++;
+    for(i = 0; i < p->nent; i++) {
+        pe = &p->ent[i];
+        mark = s_push(&path, pe->d.name);
+        if(!pe->d.isdir) {
+            if(!iflag && pe->d.nlink > 1 && seen(&pe->d))
+                goto next;
+            t = fileval(&pe->d);
+            if(aflag)
+                printamt(t, s_to_c(&path), &pe->d);
+            nk += t;
+        } else if(!seen(&pe->d) && pe->sub != NULL) {
+            t = pwalk(pe->sub);
+            nk += t;
+            t = dirval(&pe->d, t);
+            if(!sflag)
+                printamt(t, s_to_c(&path), &pe->d);
+        }
+    next:
+        s_pop(&path, mark);
+        free(pe->sub);
+    }
+    depth--;
+    free(p->ent);
+    arenafree(p->names);
+    if(iflag)
+        nk++;    /* the directory itself */
+    return dirval(&p->d, nk);
+}
+
+long long
+pdu(char *name, Dir *dir)
+{
+    pthread_t *tid;
+    Pnode root;
+    int i;
+
+    if(dir == NULL)
+        return warn(name);
+
+    if(!dir->isdir)
+        return dirval(dir, fileamt(dir));
+
+    tid = malloc(njobs*sizeof(pthread_t));
+    if(tid == NULL)
+        sysfatal("out of memory");
+
+    memset(&root, 0, sizeof root);
+    root.w.name = name;
+    root.d = *dir;
+    rootdev = dir->dev;
+    ppush(0, &root);
+    for(i = 0; i < njobs; i++)
+        if(pthread_create(&tid[i], NULL, pworker, (void*)(intptr_t)i) != 0)
+            sysfatal("can't create thread: %s", strerror(errno));
+    for(i = 0; i < njobs; i++)
+        pthread_join(tid[i], NULL);
+    free(tid);
+    s_reset(&path, name);
+    return pwalk(&root);
+}
+
+/*
+ * -E: estimate instead of counting, within a budget of stat calls
+ * (or of seconds, written 5s).  Directories above edepth are listed
+ * and stat'ed in full.  Each directory at edepth is first walked
+ * exactly on half its share of the budget; if that runs out, it is
+ * estimated by random probes.  A probe goes down one path: in each
+ * directory it stats every entry, or a sample of Esample if there
+ * are more, scales the sample up to the whole directory, and
+ * recurses into one of the sampled subdirectories, weighted by how
+ * many were sampled.  Each probe is an unbiased estimate, so their
+ * spread gives the error.  Probes count hard links once per link,
+ * and a budget smaller than two probes per directory at edepth is
+ * overrun by that much.  Otherwise a hard link is charged where the
+ * serial walk would charge it: the levels above edepth are replayed
+ * in its order, settling each directory at edepth as it comes, and
+ * an exact walk that runs out gives back the inodes it claimed.
+ */
+enum {
+    Esample = 32,
+    Emaxdepth = 256,    /* against bind-mount loops */
+};
+
+typedef struct Enode Enode;
+typedef struct Eent Eent;
+struct Enode {
+    char *path;
+    Dir d;
+    double tot;
+    double var;      /* of tot */
+    Enode **kid;
+    int nkid;
+    Enode *up;
+    Eent *ent;      /* for ereplay */
+    int nent;
+    int nleaf;      /* directories at edepth below */
+};
+
+/* a subdirectory or multiply-linked file, in readdir order */
+struct Eent {
+    Dir d;
+    Enode *sub;
+};
+
+long long    ebudget;    /* stat calls */
+double    etime;        /* or seconds */
+int    edepth = 1;
+long long    nestat;        /* stat calls so far */
+double    estart;
+uint64_t    erandstate;
+int    enleft;        /* directories at edepth still to settle */
+
+void
+estbudget(char *s)
+{
+    char *ss;
+    double v;
+
+    estflag = 1;
+    v = strtod(s, &ss);
+    if (s == ss || v <= 0)
+        usage();
+    if (*ss == 's') {
+        etime = v;
+        ss++;
+    } else
+        ebudget = v;
+    if (*ss == ',') {
+        s = ss + 1;
+        edepth = strtol(s, &ss, 0);
+        if (s == ss || edepth < 0)
+            usage();
+    }
+    if (*ss != '\0')
+        usage();
+}
+
+double
+enow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* the budget used, on the scale of whichever one was given */
+double
+eused(void)
+{
+    if(etime > 0)
+        return enow() - estart;
+    return nestat;
+}
+
+/* the share of what's left for each directory still to settle */
+double
+eshare(void)
+{
+    double budget = etime > 0 ? etime : ebudget;
+
+    return fmax(0, budget - eused()) / enleft;
+}
+
+/* uniform in [0, n); xorshift64* */
+long
+erand(long n)
+{
+    uint64_t x = erandstate;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    erandstate = x;
+    return (x * 0x2545F4914F6CDD1DULL >> 11) % n;
+}
+
+int
+estat(int dfd, char *name, Dir *d)
+{
+    nestat++;
+    if(dirstatat(dfd, name, d) < 0)
+        return -1;
+    return mflag && d->dev != rootdev ? -1 : 0;
+}
+
+/* the names in the directory open on fd, which stays open */
+int
+elist(int fd, String *names)
+{
+    DIR *dp;
+    struct dirent *e;
+    int n = 0;
+
+    dp = fdopendir(dup(fd));
+    if(dp == NULL)
+        return -1;
+    rewinddir(dp);    /* the offset is shared with fd */
+    while((e = readdir(dp)) != NULL)
+        if(strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0
+        && !excluded(e->d_name)) {
+            s_addname(names, e->d_name);
+            n++;
+        }
+    closedir(dp);
+    return n;
+}
+
+/* the exact total of the directory open on fd, or -1 past limit */
+double
+ewalk(int fd, double limit)
+{
+    String names = {NULL, 0, 0};
+    char *name;
+    double t, nk;
+    Dir d;
+    int i, n, sfd;
+
+    nk = iflag;
+    n = elist(fd, &names);
+    for(i = 0, name = names.s; i < n && nk >= 0; i++, name += strlen(name) + 1) {
+        if(eused() > limit)
+            nk = -1;
+        else if(estat(fd, name, &d) < 0)
+            continue;
+        else if(!d.isdir) {
+            if(iflag || d.nlink <= 1 || !eseen(&d))
+                nk += fileamt(&d);
+        } else if(!eseen(&d)) {
+            sfd = openat(fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+            if(sfd < 0)
+                continue;
+            t = ewalk(sfd, limit);
+            nk = t < 0 ? -1 : nk + t;
+            close(sfd);
+        }
+    }
+    free(names.s);
+    return nk;
+}
+
+/* one probe's estimate of the directory open on fd */
+double
+eprobe(int fd, int lvl)
+{
+    String names = {NULL, 0, 0};
+    char **v, *name, *t;
+    double sum;
+    Dir d;
+    int i, k, n, ndir, sfd, pick;
+
+    n = elist(fd, &names);
+    if(n <= 0) {
+        free(names.s);
+        return iflag;
+    }
+    v = malloc(n*sizeof(char*));
+    if(v == NULL)
+        sysfatal("out of memory");
+    for(i = 0, name = names.s; i < n; i++, name += strlen(name) + 1)
+        v[i] = name;
+
+    /* a partial shuffle leaves the sample at the front */
+    k = n < Esample ? n : Esample;
+    for(i = 0; i < k && k < n; i++) {
+        pick = i + erand(n - i);
+        t = v[i];
+        v[i] = v[pick];
+        v[pick] = t;
+    }
+    sum = 0;
+    ndir = 0;
+    for(i = 0; i < k; i++) {
+        if(estat(fd, v[i], &d) < 0)
+            continue;
+        if(!d.isdir)
+            sum += fileamt(&d);
+        else
+            v[ndir++] = v[i];    /* the sampled subdirectories */
+    }
+    if(ndir > 0 && lvl < Emaxdepth) {
+        sfd = openat(fd, v[erand(ndir)], O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+        if(sfd >= 0) {
+            sum += ndir * eprobe(sfd, lvl+1);
+            close(sfd);
+        }
+    }
+    free(v);
+    free(names.s);
+    return iflag + sum * n / k;
+}
+
+/* settle a directory at edepth, within share of the budget */
+void
+esettle(Enode *e, double share)
+{
+    double start, x, mean, m2, delta;
+    long long n;
+    long m;
+    int fd;
+
+    start = eused();
+    fd = open(e->path, O_RDONLY|O_DIRECTORY);
+    if(fd < 0) {
+        warn(e->path);
+        return;
+    }
+    x = ewalk(fd, start + share/2);
+    epending(x >= 0);
+    if(x >= 0) {
+        e->tot = x;
+        close(fd);
+        return;
+    }
+    /* Welford's running mean and variance of the probes */
+    mean = m2 = 0;
+    m = 0;
+    do {
+        n = nestat;
+        x = eprobe(fd, 0);
+        m++;
+        delta = x - mean;
+        mean += delta / m;
+        m2 += delta * (x - mean);
+    } while((m < 2 || eused() < start + share) && nestat > n);
+    close(fd);
+    e->tot = mean;
+    e->var = m > 1 ? m2 / (m-1) / m : 0;
+}
+
+int
+eloop(Enode *e, Dir *d)
+{
+    for(; e != NULL; e = e->up)
+        if(e->d.dev == d->dev && e->d.ino == d->ino)
+            return 1;
+    return 0;
+}
+
+void
+eaddent(Enode *e, Dir *d, Enode *sub)
+{
+    e->ent = realloc(e->ent, (e->nent+1)*sizeof(Eent));
+    if(e->ent == NULL)
+        sysfatal("out of memory");
+    e->ent[e->nent].d = *d;
+    e->ent[e->nent].sub = sub;
+    e->nent++;
+}
+
+/*
+ * list and stat the levels above edepth, leaving the rest for
+ * esettle and whatever depends on seen() for ereplay
+ */
+void
+ebuild(int fd, Enode *e, int lvl)
+{
+    String names = {NULL, 0, 0};
+    String sub = {NULL, 0, 0};
+    char *name;
+    Enode *k;
+    Dir d;
+    int i, n, sfd;
+
+    e->tot = iflag;
+    n = elist(fd, &names);
+    if(n < 0)
+        warn(e->path);
+    for(i = 0, name = names.s; i < n; i++, name += strlen(name) + 1) {
+        if(estat(fd, name, &d) < 0)
+            continue;
+        d.name = NULL;
+        if(!d.isdir && (iflag || d.nlink <= 1)) {
+            e->tot += fileamt(&d);
+            continue;
+        }
+        k = NULL;
+        if(d.isdir && !eloop(e, &d)) {
+            k = calloc(1, sizeof(Enode));
+            if(k == NULL)
+                sysfatal("out of memory");
+            s_reset(&sub, e->path);
+            s_push(&sub, name);
+            k->path = strdup(s_to_c(&sub));
+            if(k->path == NULL)
+                sysfatal("out of memory");
+            k->d = d;
+            k->up = e;
+            if(lvl+1 == edepth)
+                k->nleaf = 1;
+            else if((sfd = openat(fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW)) < 0)
+                warn(k->path);
+            else {
+                ebuild(sfd, k, lvl+1);
+                close(sfd);
+            }
+            e->nleaf += k->nleaf;
+        }
+        eaddent(e, &d, k);
+    }
+    free(names.s);
+    free(sub.s);
+}
+
+/* a subtree ereplay skips */
+void
+efree(Enode *e)
+{
+    int i;
+
+    for(i = 0; i < e->nent; i++)
+        if(e->ent[i].sub != NULL)
+            efree(e->ent[i].sub);
+    free(e->ent);
+    free(e->path);
+    free(e);
+}
+
+/*
+ * go over what ebuild found in the serial walk's order, charging
+ * hard links and settling each directory at edepth as it comes
+ */
+void
+ereplay(Enode *e, int lvl)
+{
+    Eent *t;
+    Enode *k;
+    int i;
+
+    for(i = 0; i < e->nent; i++) {
+        t = &e->ent[i];
+        k = t->sub;
+        if(!t->d.isdir) {
+            if(!seen(&t->d))
+                e->tot += fileamt(&t->d);
+        } else if(seen(&t->d) || k == NULL) {
+            if(k != NULL) {
+                enleft -= k->nleaf;
+                efree(k);
+            }
+        } else {
+            e->kid = realloc(e->kid, (e->nkid+1)*sizeof(Enode*));
+            if(e->kid == NULL)
+                sysfatal("out of memory");
+            e->kid[e->nkid++] = k;
+            if(lvl+1 == edepth) {
+                esettle(k, eshare());
+                enleft--;
+            } else
+                ereplay(k, lvl+1);
+        }
+    }
+    free(e->ent);
+    e->ent = NULL;
+    e->nent = 0;
+}
+
+/* add up and print bottom-up, as du does, freeing as we go */
+void
+eprint(Enode *e, int lvl)
+{
+    int i;
+
+    for(i = 0; i < e->nkid; i++) {
+        eprint(e->kid[i], lvl+1);
+        e->tot += e->kid[i]->tot;
+        e->var += e->kid[i]->var;
+        free(e->kid[i]->path);
+        free(e->kid[i]);
+    }
+    free(e->kid);
+    depth = lvl;
+    if(lvl == 0 || !sflag)
+        printest(llround(e->tot), llround(1.96*sqrt(e->var)), e->path, &e->d);
+}
+
+void
+etop(char *name, Dir *d)
+{
+    Enode root;
+    int fd;
+
+    if(d == NULL) {
+        warn(name);
+        return;
+    }
+    if(!d->isdir) {
+        printamt(fileamt(d), name, d);
+        return;
+    }
+    memset(&root, 0, sizeof root);
+    root.path = name;
+    root.d = *d;
+    rootdev = d->dev;
+    estart = enow();
+    nestat = 0;
+    erandstate = ((uint64_t)(estart*1e9) ^ getpid()) | 1;
+    enleft = 1;
+    if(edepth == 0)
+        esettle(&root, eshare());
+    else if((fd = open(name, O_RDONLY|O_DIRECTORY)) < 0) {
+        warn(name);
+        return;
+    } else {
+        ebuild(fd, &root, 0);
+        close(fd);
+        enleft = root.nleaf;
+        ereplay(&root, 0);
+    }
+    eprint(&root, 0);
+}
+
+/*
+ * The -C cache: per directory, the total of its plain files and the
+ * names of its subdirectories and multiply-linked files, found by
+ * (dev, ino) in a sorted table mapped straight from the file.  When
+ * a directory's mtime and ctime still match, du skips its readdir
+ * and the stat of every plain file and only revisits those names.
+ * A file rewritten in place doesn't touch its directory, so that is
+ * the one change missed; --verify rescans and reports it.
+ */
+typedef struct Thdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;       /* sizeof(Trec) */
+    int64_t blocksize;
+    uint64_t n;
+    uint64_t poolsize;
+    uint64_t xsig;       /* of the -x patterns and -m */
+} Thdr;
+
+#define    TMAGIC    "du9cache"
+
+void    *tcmap;
+size_t    tcmaplen;
+Trec    *tcold;        /* mapped from cachefile */
+size_t    ntcold;
+char    *tcoldpool;
+size_t    tcoldpoolsize;
+Trec    *tcnew;        /* records from this run */
+size_t    ntcnew;
+size_t    maxtcnew;
+String    tcnewpool;
+pthread_mutex_t tclk = PTHREAD_MUTEX_INITIALIZER;
+
+int
+treccmp(const void *va, const void *vb)
+{
+    const Trec *a = va, *b = vb;
+
+    if(a->dev != b->dev)
+        return a->dev < b->dev ? -1 : 1;
+    if(a->ino != b->ino)
+        return a->ino < b->ino ? -1 : 1;
+    return 0;
+}
+
+void
+tcload(void)
+{
+    struct stat st;
+    Thdr *h;
+    int fd;
+
+    fd = open(cachefile, O_RDONLY);
+    if(fd < 0)
+        return;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Thdr)) {
+        close(fd);
+        return;
+    }
+    tcmap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(tcmap == MAP_FAILED) {
+        tcmap = NULL;
+        return;
+    }
+    tcmaplen = st.st_size;
+    h = tcmap;
+    /* a cache from another block size, -x set, -m or layout is ignored */
+    if(memcmp(h->magic, TMAGIC, 8) != 0 || h->version != 2
+    || h->size != sizeof(Trec) || h->blocksize != blocksize || h->xsig != xsig()
+    || h->n > (tcmaplen - sizeof(Thdr)) / sizeof(Trec)
+    || sizeof(Thdr) + h->n*sizeof(Trec) + h->poolsize != tcmaplen)
+        return;
+    tcold = (Trec*)(h + 1);
+    ntcold = h->n;
+    tcoldpool = (char*)(tcold + ntcold);
+    tcoldpoolsize = h->poolsize;
+}
+
+Trec *
+tcfind(Dir *d)
+{
+    Trec key, *r;
+
+    if(ntcold == 0)
+        return NULL;
+    key.dev = d->dev;
+    key.ino = d->ino;
+    r = bsearch(&key, tcold, ntcold, sizeof(Trec), treccmp);
+    if(r == NULL || r->mns != d->mns || r->cns != d->cns)
+        return NULL;
+    if(r->off > tcoldpoolsize || r->len > tcoldpoolsize - r->off
+    || (r->len > 0 && tcoldpool[r->off + r->len - 1] != '\0'))
+        return NULL;
+    return r;
+}
+
+/* safe from the -j workers: the mapping is read-only */
+Trec *
+tcget(Dir *d)
+{
+    if(cachefile == NULL || verifyflag)
+        return NULL;
+    return tcfind(d);
+}
+
+char *
+tcnames(Trec *r)
+{
+    return tcoldpool + r->off;
+}
+
+/* record d's listing; names is used unless it came from the cache */
+void
+tcput(Dir *d, Dirents *de, long long files, String *names, char *path)
+{
+    Trec *r, *old;
+    char *p;
+    size_t n;
+
+    if(de->hit != NULL) {
+        files = de->hit->files;
+        p = tcnames(de->hit);
+        n = de->hit->len;
+    } else {
+        p = names->s;
+        n = names->len;
+    }
+    if(verifyflag && (old = tcfind(d)) != NULL && old->files != files) {
+        fprintf(stderr, "du: %s: cached %lld, scanned %lld\n",
+            path, (long long)old->files, files);
+        __atomic_add_fetch(&nverify, 1, __ATOMIC_RELAXED);
+    }
+
+    /*
+     * a change later in the same timestamp tick as d's would leave
+     * its times as they are, so a directory changed this recently
+     * isn't recorded; ls -C does the same
+     */
+    if(time(0) - d->cns/1000000000 <= 1)
+        return;
+
+    pthread_mutex_lock(&tclk);
+    if(ntcnew == maxtcnew) {
+        maxtcnew = maxtcnew ? maxtcnew*2 : 1024;
+        tcnew = realloc(tcnew, maxtcnew*sizeof(Trec));
+        if(tcnew == NULL)
+            sysfatal("out of memory");
+    }
+    r = &tcnew[ntcnew++];
+    r->dev = d->dev;
+    r->ino = d->ino;
+    r->mns = d->mns;
+    r->cns = d->cns;
+    r->files = files;
+    r->off = tcnewpool.len;
+    r->len = n;
+    s_grow(&tcnewpool, tcnewpool.len + n);
+    if(n > 0)
+        memcpy(tcnewpool.s + tcnewpool.len, p, n);
+    tcnewpool.len += n;
+    pthread_mutex_unlock(&tclk);
+}
+
+int
+tcwrite(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    ssize_t m;
+
+    while(n > 0) {
+        m = write(fd, p, n);
+        if(m <= 0)
+            return -1;
+        p += m;
+        n -= m;
+    }
+    return 0;
+}
+
+/*
+ * Merge this run's records over the old ones and replace the file
+ * by rename, so concurrent runs each see a whole cache, old or new.
+ * Old records of directories not visited this time are kept.
+ */
+void
+tcsave(void)
+{
+    Thdr h;
+    Trec *out, *r;
+    size_t i, j, n;
+    char *tmp;
+    int fd, ok;
+
+    qsort(tcnew, ntcnew, sizeof(Trec), treccmp);
+    out = malloc((ntcnew + ntcold + 1) * sizeof(Trec));
+    if(out == NULL)
+        sysfatal("out of memory");
+    i = j = n = 0;
+    while(i < ntcnew || j < ntcold) {
+        if(j == ntcold || (i < ntcnew && treccmp(&tcnew[i], &tcold[j]) <= 0)) {
+            if(j < ntcold && treccmp(&tcnew[i], &tcold[j]) == 0)
+                j++;
+            if(n == 0 || treccmp(&out[n-1], &tcnew[i]) != 0)
+                out[n++] = tcnew[i];
+            i++;
+            continue;
         }
+        /* carry the old names over into the new pool */
+        r = &tcold[j++];
+        if(r->off > tcoldpoolsize || r->len > tcoldpoolsize - r->off)
+            continue;
+        out[n] = *r;
+        out[n].off = tcnewpool.len;
+        s_grow(&tcnewpool, tcnewpool.len + r->len);
+        if(r->len > 0)
+            memcpy(tcnewpool.s + tcnewpool.len, tcoldpool + r->off, r->len);
+        tcnewpool.len += r->len;
+        n++;
+    }
 
-        t = du(s_to_c(file), d);
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, TMAGIC, 8);
+    h.version = 2;
+    h.size = sizeof(Trec);
+    h.blocksize = blocksize;
+    h.xsig = xsig();
+    h.n = n;
+    h.poolsize = tcnewpool.len;
 
-        nk += t;
-        t = dirval(d, t);
-        if(!sflag)
-            printamt(t, s_to_c(file));
-        
-        free(d);
-        s_free(file);
+    tmp = malloc(strlen(cachefile) + 8);
+    if(tmp == NULL)
+        sysfatal("out of memory");
+    sprintf(tmp, "%s.XXXXXX", cachefile);
+    fd = mkstemp(tmp);
+    if(fd < 0) {
+        warn(tmp);
+        free(tmp);
+        free(out);
+        return;
     }
-    closedir(dirp);
-    return dirval(dir, nk);
+    ok = tcwrite(fd, &h, sizeof h) == 0
+        && tcwrite(fd, out, n*sizeof(Trec)) == 0
+        && tcwrite(fd, tcnewpool.s, tcnewpool.len) == 0;
+    if(close(fd) < 0)
+        ok = 0;
+    if(!ok || rename(tmp, cachefile) < 0) {
+        warn(cachefile);
+        unlink(tmp);
+    }
+    free(tmp);
+    free(out);
+    if(tcmap != NULL)
+        munmap(tcmap, tcmaplen);
 }
 
-#define    NCACHE    256    /* must be power of two */
+/*
+ * -x prunes entries by name before they are stat'ed or entered.
+ * Patterns are compiled once: plain names go into a hash set, so
+ * any number of them costs one lookup, and the rest are matched in
+ * turn as globs (*, ? and [...]; a pattern never matches across /).
+ */
+char    **xlit;        /* open addressing; NULL is empty */
+size_t    xlitmax;
+char    **xglob;
+int    nxglob;
 
-typedef struct
+uint64_t
+strhash(char *s)
 {
-    Dir*    cache;
-    int    n;
-    int    max;
+    uint64_t h = 14695981039346656037ULL;
+
+    for(; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void
+xcompile(void)
+{
+    size_t i;
+    int k;
+
+    if(nxpat == 0)
+        return;
+    xlitmax = 16;
+    while(xlitmax < 2*(size_t)nxpat)
+        xlitmax *= 2;
+    xlit = calloc(xlitmax, sizeof(char*));
+    xglob = malloc(nxpat*sizeof(char*));
+    if(xlit == NULL || xglob == NULL)
+        sysfatal("out of memory");
+    for(k = 0; k < nxpat; k++) {
+        if(strpbrk(xpat[k], "*?[") != NULL) {
+            xglob[nxglob++] = xpat[k];
+            continue;
+        }
+        i = strhash(xpat[k]) & (xlitmax-1);
+        while(xlit[i] != NULL && strcmp(xlit[i], xpat[k]) != 0)
+            i = (i+1) & (xlitmax-1);
+        xlit[i] = xpat[k];
+    }
+}
+
+/* does c match the class at p (just past the '[')?  sets *end past ']' */
+int
+gclass(char *p, int c, char **end)
+{
+    int neg, ok, lo, first;
+
+    neg = *p == '!' || *p == '^';
+    if(neg)
+        p++;
+    ok = 0;
+    for(first = 1; *p && (*p != ']' || first); first = 0) {
+        lo = (unsigned char)*p++;
+        if(*p == '-' && p[1] && p[1] != ']') {
+            if(lo <= c && c <= (unsigned char)p[1])
+                ok = 1;
+            p += 2;
+        } else if(lo == c)
+            ok = 1;
+    }
+    if(*p != ']')
+        return -1;    /* no closing bracket: match '[' literally */
+    *end = p + 1;
+    return ok != neg;
+}
+
+/* glob match; each * is retried only from the most recent one */
+int
+gmatch(char *p, char *s)
+{
+    char *star = NULL, *ss = NULL, *e;
+    int r;
+
+    while(*s) {
+        if(*p == '*') {
+            star = ++p;
+            ss = s;
+            continue;
+        }
+        if(*p == '?') {
+            p++;
+            s++;
+            continue;
+        }
+        if(*p == '[' && (r = gclass(p+1, (unsigned char)*s, &e)) >= 0) {
+            if(r) {
+                p = e;
+                s++;
+                continue;
+            }
+        } else if(*p && *p == *s) {
+            p++;
+            s++;
+            continue;
+        }
+        if(star == NULL)
+            return 0;
+        p = star;
+        s = ++ss;
+    }
+    while(*p == '*')
+        p++;
+    return *p == '\0';
+}
+
+int
+excluded(char *name)
+{
+    size_t i;
+    int k;
+
+    if(nxpat == 0)
+        return 0;
+    i = strhash(name) & (xlitmax-1);
+    for(; xlit[i] != NULL; i = (i+1) & (xlitmax-1))
+        if(strcmp(xlit[i], name) == 0)
+            return 1;
+    for(k = 0; k < nxglob; k++)
+        if(gmatch(xglob[k], name))
+            return 1;
+    return 0;
+}
+
+/*
+ * identifies what prunes the walk, the -x set and -m, so -C can
+ * tell whose subtotals and name lists it holds
+ */
+uint64_t
+xsig(void)
+{
+    uint64_t h = 0;
+    int k;
+
+    for(k = 0; k < nxpat; k++)
+        h = (h ^ strhash(xpat[k])) * 1099511628211ULL + 1;
+    if(mflag)
+        h = (h ^ 'm') * 1099511628211ULL + 1;
+    return h;
+}
+
+/*
+ * Inodes already counted: directories, and files with more than
+ * one link.  Open addressing with linear probing; a zero key is
+ * an empty slot, since no file has device and inode both zero.
+ */
+typedef struct Key {
+    uint64_t dev;
+    uint64_t ino;
+} Key;
+
+typedef struct Cache {
+    Key *tab;
+    size_t n;
+    size_t max;    /* power of two */
 } Cache;
-Cache cache[NCACHE];
+Cache cache;
+
+size_t
+keyhash(uint64_t dev, uint64_t ino)
+{
+    uint64_t h = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void
+cachegrow(Cache *c)
+{
+    Key *old = c->tab;
+    size_t i, j, omax = c->max;
+
+    c->max = omax ? omax*2 : 1024;
+    c->tab = calloc(c->max, sizeof(Key));
+    if(c->tab == NULL)
+        err("malloc failure");
+    for(i = 0; i < omax; i++) {
+        if(old[i].dev == 0 && old[i].ino == 0)
+            continue;
+        j = keyhash(old[i].dev, old[i].ino) & (c->max-1);
+        while(c->tab[j].dev != 0 || c->tab[j].ino != 0)
+            j = (j+1) & (c->max-1);
+        c->tab[j] = old[i];
+    }
+    free(old);
+}
+
+/* add dir to c; was it there already? */
+int
+cacheadd(Cache *c, Dir *dir)
+{
+    Key *k;
+    size_t i;
+
+    if(4*(c->n+1) > 3*c->max)
+        cachegrow(c);
+    i = keyhash(dir->dev, dir->ino) & (c->max-1);
+    for(;;) {
+        k = &c->tab[i];
+        if(k->dev == 0 && k->ino == 0)
+            break;
+        if(k->ino == (uint64_t)dir->ino && k->dev == (uint64_t)dir->dev)
+            return 1;
+        i = (i+1) & (c->max-1);
+    }
+    k->dev = dir->dev;
+    k->ino = dir->ino;
+    c->n++;
+    return 0;
+}
 
 int
 seen(Dir *dir)
 {
-    Dir *dp;
-    int i;
-    Cache *c;
+    return cacheadd(&cache, dir);
+}
+
+/* is dir in c? */
+int
+cachehas(Cache *c, Dir *dir)
+{
+    Key *k;
+    size_t i;
 
-    c = &cache[dir->ino&(NCACHE-1)];
-    dp = c->cache;
-    for(i=0; i<c->n; i++, dp++)
-        if(dir->ino == dp->ino && dir->dev == dp->dev)
+    if(c->max == 0)
+        return 0;
+    i = keyhash(dir->dev, dir->ino) & (c->max-1);
+    for(k = &c->tab[i]; k->dev != 0 || k->ino != 0; k = &c->tab[i]) {
+        if(k->ino == (uint64_t)dir->ino && k->dev == (uint64_t)dir->dev)
             return 1;
-    if(c->n == c->max){
-        if (c->max == 0)
-            c->max = 8;
-        else
-            c->max += c->max/2;
-        c->cache = realloc(c->cache, c->max*sizeof(Dir));
-        if(c->cache == NULL)
-            err("malloc failure");
+        i = (i+1) & (c->max-1);
     }
-    c->cache[c->n++] = *dir;
     return 0;
 }
 
+/*
+ * -E: an exact walk may run out and be replaced by probes, so
+ * what it counts goes in pending until it finishes.
+ */
+Cache pending;
+
+int
+eseen(Dir *dir)
+{
+    return cachehas(&cache, dir) || cacheadd(&pending, dir);
+}
+
+/* move pending into cache, or drop it */
+void
+epending(int keep)
+{
+    Dir d;
+    size_t i;
+
+    for(i = 0; keep && i < pending.max; i++)
+        if(pending.tab[i].dev != 0 || pending.tab[i].ino != 0) {
+            d.dev = pending.tab[i].dev;
+            d.ino = pending.tab[i].ino;
+            seen(&d);
+        }
+    free(pending.tab);
+    memset(&pending, 0, sizeof pending);
+}
+
+/*
+ * -r -j: files with several links already read.  The scan can't
+ * use seen(), which pwalk applies later in serial order.
+ */
+Cache readcache;
+pthread_mutex_t readlk = PTHREAD_MUTEX_INITIALIZER;
+
+int
+readonce(Dir *dir)
+{
+    int r;
+
+    pthread_mutex_lock(&readlk);
+    r = !cacheadd(&readcache, dir);
+    pthread_mutex_unlock(&readlk);
+    return r;
+}
+
 void
 err(char *s)
 {
@@ -397,6 +2876,18 @@ warn(char *s)
     return 0;
 }
 
+/* spell out the path to w in s */
+void
+walkpath(Walk *w, String *s)
+{
+    if(w->up == NULL) {
+        s_reset(s, w->name);
+        return;
+    }
+    walkpath(w->up, s);
+    s_push(s, w->name);
+}
+
 /* round up n to nearest block */
 long long
 blkmultiple(long long n)
@@ -406,46 +2897,214 @@ blkmultiple(long long n)
     return ROUNDUP(n, blocksize);
 }
 
-/* String functions */
-String *
-s_new(void)
+/*
+ * --progress: the walk keeps a few counters, and a thread of their
+ * own prints them to stderr once a second: rates since the last
+ * report, a histogram of stat and readdir latency in powers of four
+ * from 1µs, and the directory whose own calls took longest so far.
+ * When the flag is off, each hook is a test and a return.
+ */
+pthread_mutex_t    ilk = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t    icond = PTHREAD_COND_INITIALIZER;
+pthread_t    itid;
+int    idone;
+double    istart;
+
+void
+iadd(long long *c, long long n)
 {
-    String *s = malloc(sizeof(String));
-    if (!s) return NULL;
-    s->s = malloc(1);
-    if (!s->s) { free(s); return NULL; }
-    s->s[0] = '\0';
-    s->len = 0;
-    s->alloc = 1;
-    return s;
+    if(progressflag)
+        __atomic_add_fetch(c, n, __ATOMIC_RELAXED);
 }
 
-String *
-s_copy(char *str)
+double
+itime(void)
 {
-    String *s = malloc(sizeof(String));
-    if (!s) return NULL;
-    s->len = strlen(str);
-    s->alloc = s->len + 1;
-    s->s = malloc(s->alloc);
-    if (!s->s) { free(s); return NULL; }
-    strcpy(s->s, str);
-    return s;
+    return progressflag ? enow() : 0;
+}
+
+/* file a call that began at t0; returns how long it took */
+double
+ilat(double t0)
+{
+    double d, b;
+    int i;
+
+    if(!progressflag)
+        return 0;
+    d = enow() - t0;
+    for(i = 0, b = 1e-6; i < Nlat-1 && d >= b; i++)
+        b *= 4;
+    iadd(&instr.lat[i], 1);
+    return d;
 }
 
 void
-s_append(String *s, char *append)
+islow(Dirents *de, char *path)
 {
-    int appendlen = strlen(append);
-    int newlen = s->len + appendlen;
-    
-    if (newlen + 1 > s->alloc) {
-        s->alloc = (newlen + 1) * 2;
+    if(!progressflag)
+        return;
+    pthread_mutex_lock(&ilk);
+    if(de->lat > instr.slowest) {
+        instr.slowest = de->lat;
+        free(instr.slowpath);
+        instr.slowpath = strdup(path);
+    }
+    pthread_mutex_unlock(&ilk);
+}
+
+/* bytes, scaled like -h */
+void
+ibytes(char *buf, int n, double v)
+{
+    int scale = 0;
+
+    while(v >= 1024 && scale < (int)(nelem(pfxes)-1)) {
+        scale++;
+        v /= 1024;
+    }
+    snprintf(buf, n, "%.1f%sB", v, pfxes[scale]);
+}
+
+void
+ireport(Instr *last, double dt)
+{
+    static char *bucket[Nlat] = {
+        "<1µs", "<4µs", "<16µs", "<64µs", "<256µs",
+        "<1ms", "<4ms", "<16ms", "<64ms", ">64ms",
+    };
+    Instr now;
+    char b[32], line[1024];
+    int i, n;
+
+    for(i = 0; i < Nlat; i++)
+        now.lat[i] = __atomic_load_n(&instr.lat[i], __ATOMIC_RELAXED);
+    now.dirs = __atomic_load_n(&instr.dirs, __ATOMIC_RELAXED);
+    now.ents = __atomic_load_n(&instr.ents, __ATOMIC_RELAXED);
+    now.bytes = __atomic_load_n(&instr.bytes, __ATOMIC_RELAXED);
+    now.reads = __atomic_load_n(&instr.reads, __ATOMIC_RELAXED);
+    ibytes(b, sizeof b, now.bytes);
+    n = snprintf(line, sizeof line, "du: %.0fs: %.0f dirs/s, %.0f entries/s, %s",
+        enow() - istart, (now.dirs - last->dirs)/dt, (now.ents - last->ents)/dt, b);
+    if(readflg)
+        n += snprintf(line+n, sizeof line-n, ", %.0f files/s queued for reading",
+            (now.reads - last->reads)/dt);
+    n += snprintf(line+n, sizeof line-n, "; latency");
+    for(i = 0; i < Nlat; i++)
+        if(now.lat[i] > 0 && n < (int)sizeof line)
+            n += snprintf(line+n, sizeof line-n, " %s:%lld", bucket[i], now.lat[i]);
+    if(instr.slowpath != NULL && n < (int)sizeof line)
+        snprintf(line+n, sizeof line-n, "; slowest %.3fs %s",
+            instr.slowest, instr.slowpath);
+    fprintf(stderr, "%s\n", line);
+    *last = now;
+}
+
+void *
+ithread(void *arg)
+{
+    Instr last;
+    struct timespec ts;
+    double t, prev;
+
+    (void)arg;
+    memset(&last, 0, sizeof last);
+    prev = enow();
+    pthread_mutex_lock(&ilk);
+    while(!idone) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec++;
+        if(pthread_cond_timedwait(&icond, &ilk, &ts) == 0 && idone)
+            break;
+        t = enow();
+        ireport(&last, t - prev);    /* under ilk, for slowpath */
+        prev = t;
+    }
+    t = enow();
+    ireport(&last, t > prev ? t - prev : 1);
+    pthread_mutex_unlock(&ilk);
+    return NULL;
+}
+
+void
+iinit(void)
+{
+    istart = enow();
+    if(pthread_create(&itid, NULL, ithread, NULL) != 0)
+        sysfatal("can't create thread: %s", strerror(errno));
+}
+
+/* stop the reports, after a last one */
+void
+ifinish(void)
+{
+    pthread_mutex_lock(&ilk);
+    idone = 1;
+    pthread_cond_signal(&icond);
+    pthread_mutex_unlock(&ilk);
+    pthread_join(itid, NULL);
+}
+
+void
+prstats(void)
+{
+    struct rusage ru;
+
+    fflush(stdout);
+    oflush();
+    if(getrusage(RUSAGE_SELF, &ru) == 0)
+        fprintf(stderr, "du: peak rss %ld KiB\n", ru.ru_maxrss);
+}
+
+/* String functions: a path buffer used as a stack of elements */
+void
+s_grow(String *s, int n)
+{
+    if (n + 1 > s->alloc) {
+        s->alloc = (n + 1) * 2;
         s->s = realloc(s->s, s->alloc);
         if (!s->s) sysfatal("out of memory");
     }
-    strcpy(s->s + s->len, append);
-    s->len = newlen;
+}
+
+void
+s_reset(String *s, char *str)
+{
+    s->len = strlen(str);
+    s_grow(s, s->len);
+    strcpy(s->s, str);
+}
+
+/* append "/elem", returning the length to s_pop back to */
+int
+s_push(String *s, char *elem)
+{
+    int len = s->len;
+    int n = strlen(elem);
+
+    s_grow(s, len + 1 + n);
+    s->s[len] = '/';
+    memcpy(s->s + len + 1, elem, n + 1);
+    s->len = len + 1 + n;
+    return len;
+}
+
+/* append name and its NUL, for lists of names */
+void
+s_addname(String *s, char *name)
+{
+    int n = strlen(name) + 1;
+
+    s_grow(s, s->len + n);
+    memcpy(s->s + s->len, name, n);
+    s->len += n;
+}
+
+void
+s_pop(String *s, int len)
+{
+    s->len = len;
+    s->s[len] = '\0';
 }
 
 char *
@@ -454,12 +3113,42 @@ s_to_c(String *s)
     return s->s;
 }
 
+char *
+arenastrdup(Arena **ap, char *str)
+{
+    Arena *a = *ap;
+    size_t n = strlen(str) + 1;
+    size_t max;
+    char *p;
+
+    if (a == NULL || a->n + n > a->max) {
+        max = a ? a->max * 2 : 256;
+        if (max > 64*1024)
+            max = 64*1024;
+        if (max < n)
+            max = n;
+        a = malloc(sizeof(Arena) + max);
+        if (a == NULL)
+            sysfatal("out of memory");
+        a->next = *ap;
+        a->n = 0;
+        a->max = max;
+        *ap = a;
+    }
+    p = a->buf + a->n;
+    memcpy(p, str, n);
+    a->n += n;
+    return p;
+}
+
 void
-s_free(String *s)
+arenafree(Arena *a)
 {
-    if (s) {
-        free(s->s);
-        free(s);
+    Arena *next;
+
+    for (; a != NULL; a = next) {
+        next = a->next;
+        free(a);
     }
 }
 
@@ -469,26 +3158,59 @@ dirstat(char *path)
 {
     struct stat st;
     Dir *d;
+    char *p;
     
     if(stat(path, &st) != 0)
         return NULL;
-        
     d = malloc(sizeof(Dir));
     if(d == NULL)
         return NULL;
-        
-    d->name = strdup(path);
-    d->mode = st.st_mode;
-    d->mtime = st.st_mtime;
-    d->atime = st.st_atime;
-    d->length = st.st_size;
-    d->dev = st.st_dev;
-    d->ino = st.st_ino;
-    d->isdir = S_ISDIR(st.st_mode);
-    
+    p = strrchr(path, '/');
+    stat2dir(&st, p != NULL ? p+1 : path, d);
     return d;
 }
 
+/* stat an open file; d->name borrows name */
+int
+fdirstat(int fd, char *name, Dir *d)
+{
+    struct stat st;
+
+    if(fstat(fd, &st) != 0)
+        return -1;
+    stat2dir(&st, name, d);
+    return 0;
+}
+
+/* like dirstat, but name is relative to dfd and symlinks aren't followed */
+int
+dirstatat(int dfd, char *name, Dir *d)
+{
+    struct stat st;
+
+    if(fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return -1;
+    stat2dir(&st, name, d);
+    return 0;
+}
+
+/* d->name borrows name */
+void
+stat2dir(struct stat *st, char *name, Dir *d)
+{
+    d->name = name;
+    d->mode = st->st_mode;
+    d->mtime = st->st_mtime;
+    d->atime = st->st_atime;
+    d->length = st->st_size;
+    d->dev = st->st_dev;
+    d->ino = st->st_ino;
+    d->nlink = st->st_nlink;
+    d->mns = st->st_mtim.tv_sec*1000000000LL + st->st_mtim.tv_nsec;
+    d->cns = st->st_ctim.tv_sec*1000000000LL + st->st_ctim.tv_nsec;
+    d->isdir = S_ISDIR(st->st_mode);
+}
+
 int
 cistrcmp(char *a, char *b)
 {
@@ -506,6 +3228,7 @@ cistrcmp(char *a, char *b)
 void
 exits(char *msg)
 {
+    oflush();
     if(msg == NULL)
         exit(0);
     else
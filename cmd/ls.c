@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,14 +12,126 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include <pthread.h>
 
+enum {
+    Dentsize = 1024 * 1024,    /* getdents64 buffer */
+    Poolsize = 256 * 1024,     /* a chunk of the name pool */
+    Obufsize = 1024 * 1024,    /* output, written a block at a time */
+    Ntime = 256,               /* minutes kept by asciitime */
+    Schunk = 64,               /* entries a stat worker takes at once */
+    Radixmin = 256,            /* -t: fewer entries are sorted by qsort */
+    Rahead = 1024,             /* -R: directories read ahead of output */
+    Capmax = 64 * 1024 * 1024, /* -C: larger listings aren't cached */
+    Nwidth = 7,                /* column widths a listing depends on */
+};
+
+/*
+ * An entry keeps only what some flag prints or sorts by: 72 bytes,
+ * where a struct stat alone is 144.
+ */
 typedef struct NDir NDir;
 struct NDir {
-    struct stat *d;
     char *name;
     char *prefix;
+    uint64_t ino;
+    uint64_t dev;
+    int64_t size;
+    int64_t mtime;
+    int64_t atime;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int16_t todo;    /* 1: still to be stat'ed, -1: stat failed */
+    uint16_t dtype;  /* the type readdir gave */
+};
+
+/* what output sorts: a key taken from an entry, and its index */
+typedef struct Skey {
+    uint64_t key;
+    uint32_t i;
+} Skey;
+
+typedef struct Pool Pool;
+struct Pool {
+    Pool *next;
+    size_t n;
+    size_t max;
+    char buf[];
+};
+
+/* a growing list of entries and the pool holding their names */
+typedef struct Ents Ents;
+struct Ents {
+    NDir *ent;
+    int n;
+    int max;
+    Pool *pool;
+};
+
+/*
+ * A directory of a -R walk.  Workers load it into its own e; the
+ * main thread prints it when its turn comes in the walk's order.
+ */
+typedef struct Rdir Rdir;
+struct Rdir {
+    char *path;    /* to open */
+    char *pfx;     /* printed before the names: a tail of path, or NULL */
+    Rdir *parent;  /* printed after r, so alive while r is loaded */
+    uint64_t dev;  /* set by rload */
+    uint64_t ino;
+    Ents e;
+    int err;       /* errno of a failed open or read */
+    int cycle;     /* r repeats an ancestor, so isn't read */
+    int state;
+    int ent;       /* its index among the parent's entries */
+    Rdir *next;    /* on the queue */
+    Rdir *prev;
+    Rdir **kid;    /* subdirectories, in entry order */
+    int nkid;
+};
+
+enum { Rqueued, Rloading, Rloaded };
+
+/*
+ * A -C cache file: this header, the prefix the listing was printed
+ * with, then the listing's bytes.
+ */
+typedef struct Chdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mns;        /* the directory's mtime and ctime in ns */
+    int64_t cns;
+    int64_t day;        /* -l: dates print relative to today */
+    int32_t win[Nwidth];    /* widths before and after the listing */
+    int32_t wout[Nwidth];
+    uint32_t pfxlen;
+    uint64_t len;
+} Chdr;
+
+#define CMAGIC "ls9cache"
+
+/* a uid or gid and its name, ??? if it has none */
+typedef struct Idname Idname;
+struct Idname {
+    unsigned id;
+    int used;
+    char *name;
+    int len;
 };
 
+typedef struct Idtab {
+    Idname *tab;
+    int n;
+    int max;
+} Idtab;
+
 int errs = 0;
 int dflag;
 int lflag;
@@ -28,25 +141,52 @@ int pflag;
 int qflag;
 int Qflag;
 int rflag;
+int Rflag;
 int sflag;
 int tflag;
 int Tflag;
 int uflag;
 int Fflag;
-int ndirbuf;
-int ndir;
-NDir *dirbuf;
+int Cflag;
+int statall;        /* some flag needs more than name and type */
+int streaming;      /* -n with no padded columns: print as we read */
+int nstatproc = 16; /* -j: stat threads; network file systems want many */
+Ents cur;           /* the batch output() prints next */
+Skey *keys;
+Skey *keytmp;
+int nkeys;
+char *dentbuf;
+Idtab users;
+Idtab groups;
 
 int ls(char *, int);
+int lsr(char *, int);
+int needstat(int);
+long readbuf(Ents *, int, char *, char *, int *);
+void statents(Ents *, int, int, int, int);
+void statbatch(Ents *, int, int, int, int);
 int compar(NDir *, NDir *);
+void setstat(NDir *, struct stat *);
+void sortents(void);
 char *asciitime(time_t);
 char *darwx(mode_t);
 void rwx(mode_t, char *);
-void growto(long);
-void dowidths(struct stat *, const char *name);
-void format(struct stat *db, const char *name, const char *display_name, FILE *out);
+void growto(Ents *, long);
+char *pooldup(Ents *, char *);
+void poolfree(Ents *);
+Idname *idname(Idtab *, unsigned);
+void dowidths(NDir *);
+void format(NDir *, const char *display_name);
+void oflush(void);
+void oput(const char *, int);
+void onum(unsigned long, int);
+void ohex(unsigned long, int);
+void opad(const char *, int, int);
 void output(void);
 char *xcleanname(char *);
+int chit(struct stat *, char *);
+void cbegin(void);
+void cend(struct stat *, char *);
 
 time_t clk;
 int swidth;         /* max width of -s size */
@@ -58,7 +198,7 @@ int lwidth;         /* max width of length */
 int gwidth;         /* max width of groupid */
 
 void usage(void) {
-    fprintf(stderr, "usage: ls [-dlmnpqrstuFQT] [file ...]\n");
+    fprintf(stderr, "usage: ls [-dlmnpqrstuCFQRT] [-j nproc] [file ...]\n");
     exit(1);
 }
 
@@ -67,10 +207,16 @@ int main(int argc, char *argv[]) {
     int opt;
 
     /* Modified getopt handling to work with separate -d -l */
-    while ((opt = getopt(argc, argv, "Fd:l:mnpqrstuQT")) != -1) {
+    while ((opt = getopt(argc, argv, "CFd:j:l:mnpqrstuQRT")) != -1) {
         switch (opt) {
+            case 'C': Cflag = 1; break;
             case 'F': Fflag = 1; break;
             case 'd': dflag = 1; break;
+            case 'j':
+                nstatproc = atoi(optarg);
+                if (nstatproc < 1)
+                    usage();
+                break;
             case 'l': lflag = 1; break;
             case 'm': mflag = 1; break;
             case 'n': nflag = 1; break;
@@ -78,6 +224,7 @@ int main(int argc, char *argv[]) {
             case 'q': qflag = 1; break;
             case 'Q': Qflag = 1; break;
             case 'r': rflag = 1; break;
+            case 'R': Rflag = 1; break;
             case 's': sflag = 1; break;
             case 't': tflag = 1; break;
             case 'T': Tflag = 1; break;
@@ -88,6 +235,8 @@ int main(int argc, char *argv[]) {
     }
     argc -= optind;
     argv += optind;
+    statall = lflag || sflag || tflag || qflag || mflag || uflag || Tflag;
+    streaming = nflag && !lflag && !sflag && !qflag && !mflag && !Rflag;
 
     if (lflag)
         clk = time(0);
@@ -101,12 +250,10 @@ int main(int argc, char *argv[]) {
 }
 
 int ls(char *s, int multi) {
-    DIR *dir;
-    struct dirent *de;
     struct stat st;
-    char *p;
-    int n = 0;
-    char path[4096];
+    char *p, *pfx;
+    long nb;
+    int fd, first, nst;
 
     if (stat(s, &st) < 0) {
     error:
@@ -116,238 +263,1053 @@ int ls(char *s, int multi) {
 
     if (S_ISDIR(st.st_mode) && dflag == 0) {
         output();
-        dir = opendir(s);
-        if (dir == NULL)
+        fd = open(s, O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
             goto error;
-
-        // First count the number of entries
-        while ((de = readdir(dir)) != NULL)
-            n++;
-        rewinddir(dir);
-
-        growto(ndir + n);
-        n = 0;
-        while ((de = readdir(dir)) != NULL) {
-            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
-                continue;
-
-            snprintf(path, sizeof(path), "%s/%s", s, de->d_name);
-            dirbuf[ndir + n].d = malloc(sizeof(struct stat));
-            if (stat(path, dirbuf[ndir + n].d) < 0) {
-                free(dirbuf[ndir + n].d);
-                continue;
+        if (dentbuf == NULL && (dentbuf = malloc(Dentsize)) == NULL) {
+            fprintf(stderr, "ls: malloc fail\n");
+            exit(1);
+        }
+        if (Rflag) {
+            close(fd);
+            return lsr(s, multi);
+        }
+        if (Cflag) {
+            if (chit(&st, multi ? s : "")) {
+                close(fd);
+                return 0;
             }
-            dirbuf[ndir + n].name = strdup(de->d_name);
-            dirbuf[ndir + n].prefix = multi ? strdup(s) : NULL;
-            n++;
+            cbegin();
         }
-        ndir += n;
-        closedir(dir);
+        pfx = multi ? pooldup(&cur, s) : NULL;
+        first = cur.n;
+        nst = 0;
+        while ((nb = readbuf(&cur, fd, dentbuf, pfx, &nst)) > 0) {
+            if (streaming) {
+                /* each buffer's worth goes out before the next read */
+                statbatch(&cur, fd, first, nst, nstatproc);
+                output();
+                pfx = multi ? pooldup(&cur, s) : NULL;
+                nst = 0;
+            }
+        }
+        if (nb < 0)
+            fprintf(stderr, "ls: %s: %s\n", s, strerror(errno));
+        statbatch(&cur, fd, first, nst, nstatproc);
+        close(fd);
         output();
+        if (Cflag)
+            cend(nb < 0 ? NULL : &st, multi ? s : "");
+        return nb < 0;
     } else {
-        growto(ndir + 1);
-        dirbuf[ndir].d = malloc(sizeof(struct stat));
-        memcpy(dirbuf[ndir].d, &st, sizeof(struct stat));
-        dirbuf[ndir].name = strdup(s);
-        dirbuf[ndir].prefix = NULL;
+        growto(&cur, cur.n + 1);
+        setstat(&cur.ent[cur.n], &st);
+        cur.ent[cur.n].todo = 0;
+        cur.ent[cur.n].name = pooldup(&cur, s);
+        cur.ent[cur.n].prefix = NULL;
         xcleanname(s);
         p = strrchr(s, '/');
         if (p) {
-            dirbuf[ndir].prefix = strdup(s);
+            /* print as given: the prefix and the last element */
+            cur.ent[cur.n].name = pooldup(&cur, p + 1);
             *p = 0;
+            cur.ent[cur.n].prefix = pooldup(&cur, s);
         }
-        ndir++;
+        cur.n++;
     }
     return 0;
 }
 
-void output(void) {
+/*
+ * Names live in a pool of large chunks, freed all at once when a
+ * batch has been printed.
+ */
+char *pooldup(Ents *e, char *s) {
+    size_t n = strlen(s) + 1;
+    Pool *p = e->pool;
+
+    if (p == NULL || p->n + n > p->max) {
+        p = malloc(sizeof(Pool) + (n > Poolsize ? n : Poolsize));
+        if (p == NULL) {
+            fprintf(stderr, "ls: malloc fail\n");
+            exit(1);
+        }
+        p->n = 0;
+        p->max = n > Poolsize ? n : Poolsize;
+        p->next = e->pool;
+        e->pool = p;
+    }
+    memcpy(p->buf + p->n, s, n);
+    p->n += n;
+    return p->buf + p->n - n;
+}
+
+void poolfree(Ents *e) {
+    Pool *p;
+
+    while ((p = e->pool) != NULL) {
+        e->pool = p->next;
+        free(p);
+    }
+}
+
+/*
+ * Read one getdents64 buffer's worth of dir fd into e: the buffer
+ * holds thousands of entries per call.  Returns what getdents64 did.
+ */
+long readbuf(Ents *e, int fd, char *buf, char *pfx, int *nst) {
+    struct dirent64 *de;
+    NDir *d;
+    long nb, off;
+
+    nb = syscall(SYS_getdents64, fd, buf, Dentsize);
+    for (off = 0; off < nb; off += de->d_reclen) {
+        de = (struct dirent64 *)(buf + off);
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        growto(e, e->n + 1);
+        d = &e->ent[e->n++];
+        memset(d, 0, sizeof(NDir));
+        d->dtype = de->d_type;
+        d->todo = needstat(de->d_type);
+        if (d->todo)
+            (*nst)++;
+        else    /* the type from readdir is all that gets printed */
+            d->mode = DTTOIF(de->d_type);
+        d->name = pooldup(e, de->d_name);
+        d->prefix = pfx;
+    }
+    return nb;
+}
+
+/*
+ * Stat the entries of e from first on that are marked todo,
+ * relative to the directory open on fd.  Over a network each stat
+ * is a round trip, so with enough of them a pool of threads takes
+ * chunks of indexes and keeps many in flight; every result lands in
+ * its own slot, so the outcome doesn't depend on the scheduling.
+ */
+typedef struct Statjob {
+    Ents *e;
+    int fd;
+    long next;
+    long end;
+} Statjob;
+
+void *statworker(void *arg) {
+    Statjob *j = arg;
+    struct stat st;
+    long i, lo, hi;
+
+    for (;;) {
+        lo = __atomic_fetch_add(&j->next, Schunk, __ATOMIC_RELAXED);
+        if (lo >= j->end)
+            return NULL;
+        hi = lo + Schunk < j->end ? lo + Schunk : j->end;
+        for (i = lo; i < hi; i++) {
+            if (!j->e->ent[i].todo)
+                continue;
+            /* a dangling symlink is listed as the link, as without -l */
+            if (fstatat(j->fd, j->e->ent[i].name, &st, 0) < 0
+             && fstatat(j->fd, j->e->ent[i].name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                j->e->ent[i].todo = -1;
+            else {
+                setstat(&j->e->ent[i], &st);
+                j->e->ent[i].todo = 0;
+            }
+        }
+    }
+}
+
+/* stat what needs it and drop what couldn't be, keeping the order */
+void statbatch(Ents *e, int fd, int first, int nst, int nproc) {
+    int i, j;
+
+    if (nst == 0)
+        return;
+    statents(e, fd, first, nst, nproc);
+    for (i = j = first; i < e->n; i++)
+        if (e->ent[i].todo == 0)
+            e->ent[j++] = e->ent[i];
+    e->n = j;
+}
+
+void statents(Ents *e, int fd, int first, int nst, int nproc) {
+    pthread_t tid[256];
+    Statjob j;
+    int i, n;
+
+    j.e = e;
+    j.fd = fd;
+    j.next = first;
+    j.end = e->n;
+    n = nst / (2 * Schunk);
+    if (n > nproc - 1)
+        n = nproc - 1;    /* this thread is one of them */
+    if (n > (int)(sizeof tid / sizeof tid[0]))
+        n = sizeof tid / sizeof tid[0];
+    for (i = 0; i < n; i++)
+        if (pthread_create(&tid[i], NULL, statworker, &j) != 0)
+            break;
+    n = i;
+    statworker(&j);    /* this thread helps, and does it all if n is 0 */
+    for (i = 0; i < n; i++)
+        pthread_join(tid[i], NULL);
+}
+
+/*
+ * Does an entry of this readdir type have to be stat'ed?  A plain
+ * listing needs only names; -F needs no more for a directory, but an
+ * executable or the target of a symlink takes the mode.
+ */
+int needstat(int type) {
+    if (statall || type == DT_UNKNOWN)
+        return 1;
+    if (Fflag)
+        return type != DT_DIR;
+    return 0;
+}
+
+/*
+ * -R walks the tree with a pool of threads, each reading and
+ * stat'ing whole directories off a shared stack, while this thread
+ * prints them depth first in the order the listing shows them.  A
+ * directory done ahead of its turn waits, loaded, until it comes
+ * up; one whose turn comes first is loaded here rather than waited
+ * for.  Entries are named by their path from the argument, so the
+ * output is one line per file, whatever the scheduling.
+ */
+pthread_mutex_t rlk = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t rcond = PTHREAD_COND_INITIALIZER;
+Rdir *rqueue;
+int rahead;         /* loaded and not yet printed */
+int rdone;
+
+Rdir *rnew(char *dir, char *name, int skip) {
+    Rdir *r;
+    size_t n;
+
+    r = calloc(1, sizeof(Rdir));
+    n = strlen(dir);
+    if (r == NULL || (r->path = malloc(n + strlen(name) + 2)) == NULL) {
+        fprintf(stderr, "ls: malloc fail\n");
+        exit(1);
+    }
+    if (*name == 0)
+        strcpy(r->path, dir);
+    else if (n > 0 && dir[n - 1] == '/')
+        sprintf(r->path, "%s%s", dir, name);
+    else
+        sprintf(r->path, "%s/%s", dir, name);
+    r->pfx = skip < 0 ? NULL : r->path + skip;
+    return r;
+}
+
+/* read r, stat what's needed, and make an Rdir of each subdirectory */
+void rload(Rdir *r, char *buf, int nproc) {
+    struct stat st;
+    Rdir *p;
+    NDir *d;
+    long nb;
+    int fd, i, nst, skip;
+
+    fd = open(r->path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        r->err = errno;
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    /* a bind mount of an ancestor would recurse forever */
+    r->dev = st.st_dev;
+    r->ino = st.st_ino;
+    for (p = r->parent; p != NULL; p = p->parent)
+        if (p->dev == r->dev && p->ino == r->ino) {
+            r->cycle = 1;
+            close(fd);
+            return;
+        }
+    nst = 0;
+    while ((nb = readbuf(&r->e, fd, buf, r->pfx, &nst)) > 0)
+        ;
+    if (nb < 0)
+        r->err = errno;
+    statbatch(&r->e, fd, 0, nst, nproc);
+
+    /* by the type readdir gave, so a symlink is never followed */
+    skip = r->pfx ? r->pfx - r->path : (int)strlen(r->path);
+    if (skip > 0 && r->path[skip - 1] != '/')
+        skip++;
+    for (i = 0; i < r->e.n; i++) {
+        d = &r->e.ent[i];
+        if (d->dtype == DT_UNKNOWN) {
+            if (fstatat(fd, d->name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISDIR(st.st_mode))
+                continue;
+        } else if (d->dtype != DT_DIR)
+            continue;
+        if ((r->nkid & (r->nkid - 1)) == 0) {
+            r->kid = realloc(r->kid, (r->nkid ? 2 * r->nkid : 1) * sizeof(Rdir *));
+            if (r->kid == NULL) {
+                fprintf(stderr, "ls: malloc fail\n");
+                exit(1);
+            }
+        }
+        r->kid[r->nkid] = rnew(r->path, d->name, skip);
+        r->kid[r->nkid]->parent = r;
+        r->kid[r->nkid++]->ent = i;
+    }
+    close(fd);
+}
+
+/* with rlk held: take r off the queue */
+void runqueue(Rdir *r) {
+    if (r->prev)
+        r->prev->next = r->next;
+    else
+        rqueue = r->next;
+    if (r->next)
+        r->next->prev = r->prev;
+    r->next = r->prev = NULL;
+}
+
+/* with rlk held: r is loaded, so its subdirectories can be */
+void rloaded(Rdir *r) {
     int i;
+
+    for (i = r->nkid - 1; i >= 0; i--) {
+        r->kid[i]->next = rqueue;
+        if (rqueue)
+            rqueue->prev = r->kid[i];
+        rqueue = r->kid[i];
+    }
+    r->state = Rloaded;
+    rahead++;
+    pthread_cond_broadcast(&rcond);
+}
+
+void *rworker(void *arg) {
+    char *buf;
+    Rdir *r;
+
+    (void)arg;
+    if ((buf = malloc(Dentsize)) == NULL) {
+        fprintf(stderr, "ls: malloc fail\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&rlk);
+    for (;;) {
+        while (!rdone && (rqueue == NULL || rahead >= Rahead))
+            pthread_cond_wait(&rcond, &rlk);
+        if (rdone)
+            break;
+        r = rqueue;
+        runqueue(r);
+        r->state = Rloading;
+        pthread_mutex_unlock(&rlk);
+        rload(r, buf, 1);
+        pthread_mutex_lock(&rlk);
+        rloaded(r);
+    }
+    pthread_mutex_unlock(&rlk);
+    free(buf);
+    return NULL;
+}
+
+/* print r when it's loaded, then its subdirectories in listed order */
+void remit(Rdir *r) {
+    Rdir **byent;
+    int i, k, n;
+
+    pthread_mutex_lock(&rlk);
+    while (r->state != Rloaded) {
+        if (r->state == Rqueued) {
+            runqueue(r);
+            r->state = Rloading;
+            pthread_mutex_unlock(&rlk);
+            rload(r, dentbuf, nstatproc);
+            pthread_mutex_lock(&rlk);
+            rloaded(r);
+        } else
+            pthread_cond_wait(&rcond, &rlk);
+    }
+    rahead--;
+    pthread_cond_broadcast(&rcond);
+    pthread_mutex_unlock(&rlk);
+
+    if (r->err) {
+        fprintf(stderr, "ls: %s: %s\n", r->path, strerror(r->err));
+        errs = 1;
+    }
+    if (r->cycle) {
+        fprintf(stderr, "ls: %s: directory cycle\n", r->path);
+        errs = 1;
+    }
+    free(cur.ent);
+    cur = r->e;
+    n = cur.n;
+    output();
+
+    /*
+     * output left keys in the listing's order; put the subdirectories
+     * in it before printing them overwrites keys
+     */
+    byent = calloc(n + 1, sizeof(Rdir *));
+    if (byent == NULL) {
+        fprintf(stderr, "ls: malloc fail\n");
+        exit(1);
+    }
+    for (i = 0; i < r->nkid; i++)
+        byent[r->kid[i]->ent] = r->kid[i];
+    for (i = k = 0; k < n; k++)
+        if (byent[keys[!nflag && rflag ? n - 1 - k : k].i])
+            r->kid[i++] = byent[keys[!nflag && rflag ? n - 1 - k : k].i];
+    free(byent);
+    for (i = 0; i < r->nkid; i++)
+        remit(r->kid[i]);
+    free(r->kid);
+    free(r->path);
+    free(r);
+}
+
+int lsr(char *s, int multi) {
+    pthread_t tid[256];
+    Rdir *r;
+    int i, n;
+
+    r = rnew(s, "", multi ? 0 : -1);
+    n = nstatproc - 1;    /* this thread is one of them */
+    if (n > (int)(sizeof tid / sizeof tid[0]))
+        n = sizeof tid / sizeof tid[0];
+    rdone = 0;
+    rqueue = r;
+    for (i = 0; i < n; i++)
+        if (pthread_create(&tid[i], NULL, rworker, NULL) != 0)
+            break;
+    n = i;
+    remit(r);
+    pthread_mutex_lock(&rlk);
+    rdone = 1;
+    pthread_cond_broadcast(&rcond);
+    pthread_mutex_unlock(&rlk);
+    for (i = 0; i < n; i++)
+        pthread_join(tid[i], NULL);
+    return errs;
+}
+
+void output(void) {
+    int i, k;
     char buf[4096];
     char *s;
+    NDir *d;
 
+    if (cur.n > nkeys) {
+        nkeys = cur.max;
+        keys = realloc(keys, nkeys * sizeof(Skey));
+        keytmp = realloc(keytmp, nkeys * sizeof(Skey));
+        if (keys == NULL || keytmp == NULL) {
+            fprintf(stderr, "ls: malloc fail\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < cur.n; i++)
+        keys[i].i = i;
     if (!nflag)
-        qsort(dirbuf, ndir, sizeof(dirbuf[0]), (int (*)(const void *, const void *))compar);
-    for (i = 0; i < ndir; i++)
-        dowidths(dirbuf[i].d, dirbuf[i].name);
-    for (i = 0; i < ndir; i++) {
-        if (!pflag && (s = dirbuf[i].prefix)) {
+        sortents();
+    for (i = 0; i < cur.n; i++)
+        dowidths(&cur.ent[i]);
+    for (k = 0; k < cur.n; k++) {
+        d = &cur.ent[keys[!nflag && rflag ? cur.n - 1 - k : k].i];
+        if (!pflag && (s = d->prefix)) {
             if (strcmp(s, "/") == 0)  /* / is a special case */
                 s = "";
-            snprintf(buf, sizeof(buf), "%s/%s", s, dirbuf[i].name);
-            format(dirbuf[i].d, buf, buf, stdout);
+            snprintf(buf, sizeof(buf), "%s/%s", s, d->name);
+            format(d, buf);
         } else
-            format(dirbuf[i].d, dirbuf[i].name, dirbuf[i].name, stdout);
-    }
-    for (i = 0; i < ndir; i++) {
-        free(dirbuf[i].d);
-        free(dirbuf[i].name);
-        if (dirbuf[i].prefix)
-            free(dirbuf[i].prefix);
+            format(d, d->name);
     }
-    ndir = 0;
-    fflush(stdout);
+    poolfree(&cur);
+    cur.n = 0;
+    oflush();
 }
 
-void dowidths(struct stat *db, const char *name) {
+void dowidths(NDir *db) {
     char buf[256];
     int n;
-    struct passwd *pw;
-    struct group *gr;
 
     if (sflag) {
-        n = snprintf(buf, sizeof(buf), "%lu", (db->st_size + 1023) / 1024);
+        n = snprintf(buf, sizeof(buf), "%lu", (db->size + 1023) / 1024);
         if (n > swidth)
             swidth = n;
     }
     if (qflag) {
-        n = snprintf(buf, sizeof(buf), "%lu", (unsigned long)db->st_ino);
+        n = snprintf(buf, sizeof(buf), "%lu", (unsigned long)db->ino);
         if (n > qwidth)
             qwidth = n;
     }
     if (mflag) {
-        pw = getpwuid(db->st_uid);
-        n = snprintf(buf, sizeof(buf), "[%s]", pw ? pw->pw_name : "???");
+        n = idname(&users, db->uid)->len + 2;
         if (n > mwidth)
             mwidth = n;
     }
     if (lflag) {
-        n = snprintf(buf, sizeof(buf), "%lu", (unsigned long)db->st_dev);
+        n = snprintf(buf, sizeof(buf), "%lu", (unsigned long)db->dev);
         if (n > vwidth)
             vwidth = n;
-        pw = getpwuid(db->st_uid);
-        n = snprintf(buf, sizeof(buf), "%s", pw ? pw->pw_name : "???");
+        n = idname(&users, db->uid)->len;
         if (n > uwidth)
             uwidth = n;
-        gr = getgrgid(db->st_gid);
-        n = snprintf(buf, sizeof(buf), "%s", gr ? gr->gr_name : "???");
+        n = idname(&groups, db->gid)->len;
         if (n > gwidth)
             gwidth = n;
-        n = snprintf(buf, sizeof(buf), "%lu", (unsigned long)db->st_size);
+        n = snprintf(buf, sizeof(buf), "%lu", (unsigned long)db->size);
         if (n > lwidth)
             lwidth = n;
     }
 }
 
-char *fileflag(struct stat *db) {
+char *fileflag(NDir *db) {
     if (Fflag == 0)
         return "";
-    if (S_ISDIR(db->st_mode))
+    if (S_ISDIR(db->mode))
         return "/";
-    if (db->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))
+    if (S_ISLNK(db->mode))    /* dangling; its 0777 means nothing */
+        return "";
+    if (db->mode & (S_IXUSR | S_IXGRP | S_IXOTH))
         return "*";
     return "";
 }
 
- void format(struct stat *db, const char *name, const char *display_name, FILE *out) {
-    int i;
-    struct passwd *pw;
-    struct group *gr;
+/*
+ * Rows are rendered by hand into one large buffer, which goes out
+ * with a single write whenever it fills and after each batch.
+ */
+void format(NDir *db, const char *display_name) {
+    Idname *u, *g;
     char modestr[11];
-    const char *type = "?";
-    char uidbuf[32], gidbuf[32];
+    char type = '?';
+    char *flag, *t;
 
-    if (S_ISREG(db->st_mode)) type = "-";
-    if (S_ISDIR(db->st_mode)) type = "d";
-    if (S_ISCHR(db->st_mode)) type = "c";
-    if (S_ISBLK(db->st_mode)) type = "b";
-    if (S_ISFIFO(db->st_mode)) type = "p";
-    if (S_ISLNK(db->st_mode)) type = "l";
-    if (S_ISSOCK(db->st_mode)) type = "s";
+    if (S_ISREG(db->mode)) type = '-';
+    if (S_ISDIR(db->mode)) type = 'd';
+    if (S_ISCHR(db->mode)) type = 'c';
+    if (S_ISBLK(db->mode)) type = 'b';
+    if (S_ISFIFO(db->mode)) type = 'p';
+    if (S_ISLNK(db->mode)) type = 'l';
+    if (S_ISSOCK(db->mode)) type = 's';
 
-    rwx(db->st_mode, modestr);
-
-    if (sflag)
-        fprintf(out, "%*lu ", swidth, (db->st_size + 1023) / 1024);
+    if (sflag) {
+        onum((db->size + 1023) / 1024, swidth);
+        oput(" ", 1);
+    }
     if (mflag) {
-        pw = getpwuid(db->st_uid);
-        fprintf(out, "[%s] ", pw ? pw->pw_name : "???");
-        for (i = 2 + (pw ? strlen(pw->pw_name) : 3); i < mwidth; i++)
-            fprintf(out, " ");
-    }
-    if (qflag)
-        fprintf(out, "(%.16lx %*lu %.2x) ",
-               (unsigned long)db->st_ino,
-               qwidth, (unsigned long)db->st_ino,
-               (unsigned)db->st_mode & S_IFMT);
+        u = idname(&users, db->uid);
+        oput("[", 1);
+        oput(u->name, u->len);
+        opad("] ", 2, mwidth - u->len);
+    }
+    if (qflag) {
+        oput("(", 1);
+        ohex(db->ino, 16);
+        oput(" ", 1);
+        onum(db->ino, qwidth);
+        oput(" ", 1);
+        ohex(db->mode & S_IFMT, 2);
+        oput(") ", 2);
+    }
     if (Tflag)
-        fprintf(out, "%c ", (db->st_mode & S_ISVTX) ? 't' : '-');
+        oput(db->mode & S_ISVTX ? "t " : "- ", 2);
 
     if (lflag) {
-        pw = getpwuid(db->st_uid);
-        gr = getgrgid(db->st_gid);
-        snprintf(uidbuf, sizeof(uidbuf), "%s", pw ? pw->pw_name : "???");
-        snprintf(gidbuf, sizeof(gidbuf), "%s", gr ? gr->gr_name : "???");
-        fprintf(out, "%s%s %c %*lu %*s %*s %*lu %s ",
-               type, modestr + 1, type[0],
-               vwidth, (unsigned long)db->st_dev,
-               -uwidth, uidbuf,
-               -gwidth, gidbuf,
-               lwidth, (unsigned long)db->st_size,
-               asciitime(uflag ? db->st_atime : db->st_mtime));
-    }
-    fprintf(out, Qflag ? "%s%s\n" : "%s%s\n", display_name, fileflag(db));
-}
-
-void growto(long n) {
-    if (n <= ndirbuf)
-        return;
-    ndirbuf = n;
-    dirbuf = realloc(dirbuf, ndirbuf * sizeof(NDir));
-    if (dirbuf == NULL) {
+        rwx(db->mode, modestr);
+        u = idname(&users, db->uid);
+        g = idname(&groups, db->gid);
+        oput(&type, 1);
+        oput(modestr + 1, 9);
+        oput(" ", 1);
+        oput(&type, 1);
+        oput(" ", 1);
+        onum(db->dev, vwidth);
+        oput(" ", 1);
+        opad(u->name, u->len, uwidth);
+        oput(" ", 1);
+        opad(g->name, g->len, gwidth);
+        oput(" ", 1);
+        onum(db->size, lwidth);
+        oput(" ", 1);
+        t = asciitime(uflag ? db->atime : db->mtime);
+        oput(t, strlen(t));
+        oput(" ", 1);
+    }
+    oput(display_name, strlen(display_name));
+    flag = fileflag(db);
+    oput(flag, strlen(flag));
+    oput("\n", 1);
+}
+
+char obuf[Obufsize];
+int nobuf;
+
+void owrite(const char *p, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(1, p, len);
+        if (n <= 0) {
+            fprintf(stderr, "ls: write error: %s\n", strerror(errno));
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/* -C: what's printed between cbegin and cend, unless it grows too big */
+char *cap;
+size_t ncap;
+size_t maxcap;
+int capturing;
+
+void oflush(void) {
+    if (capturing && nobuf > 0) {
+        if (ncap + nobuf > maxcap) {
+            maxcap = 2 * (ncap + nobuf);
+            if (maxcap > Capmax || (cap = realloc(cap, maxcap)) == NULL) {
+                capturing = 0;
+                maxcap = 0;
+                free(cap);
+                cap = NULL;
+            }
+        }
+        if (capturing) {
+            memcpy(cap + ncap, obuf, nobuf);
+            ncap += nobuf;
+        }
+    }
+    owrite(obuf, nobuf);
+    nobuf = 0;
+}
+
+void oput(const char *s, int n) {
+    if (nobuf + n > Obufsize)
+        oflush();
+    memcpy(obuf + nobuf, s, n);
+    nobuf += n;
+}
+
+/* v in decimal, right-aligned in width */
+void onum(unsigned long v, int width) {
+    char buf[24], *p = buf + sizeof buf;
+
+    do
+        *--p = '0' + v % 10;
+    while ((v /= 10) != 0);
+    opad(p, buf + sizeof buf - p, -width);
+}
+
+/* v in hex, zero-filled to at least ndig digits */
+void ohex(unsigned long v, int ndig) {
+    char buf[24], *p = buf + sizeof buf;
+
+    do
+        *--p = "0123456789abcdef"[v & 15];
+    while ((v >>= 4) != 0 || buf + sizeof buf - p < ndig);
+    oput(p, buf + sizeof buf - p);
+}
+
+/* s padded with blanks to width: on the right, or on the left if width < 0 */
+void opad(const char *s, int n, int width) {
+    static char blanks[] = "                                ";
+    int pad = (width < 0 ? -width : width) - n;
+
+    if (width > 0)
+        oput(s, n);
+    for (; pad > 0; pad -= sizeof blanks - 1)
+        oput(blanks, pad < (int)sizeof blanks - 1 ? pad : (int)sizeof blanks - 1);
+    if (width <= 0)
+        oput(s, n);
+}
+
+/*
+ * User and group names, looked up in NSS once per id.  An id with no
+ * name is remembered too, as ???, since with sssd or LDAP a miss
+ * costs as much as a hit.
+ */
+Idname *idname(Idtab *t, unsigned id) {
+    Idname *e, *old;
+    struct passwd *pw;
+    struct group *gr;
+    char *s;
+    int i, omax;
+
+    if (4 * (t->n + 1) > 3 * t->max) {
+        old = t->tab;
+        omax = t->max;
+        t->max = omax ? 2 * omax : 64;
+        t->tab = calloc(t->max, sizeof(Idname));
+        if (t->tab == NULL) {
+            fprintf(stderr, "ls: malloc fail\n");
+            exit(1);
+        }
+        for (i = 0; i < omax; i++) {
+            if (!old[i].used)
+                continue;
+            e = &t->tab[(old[i].id * 2654435761u) & (t->max - 1)];
+            while (e->used)
+                e = e == &t->tab[t->max - 1] ? t->tab : e + 1;
+            *e = old[i];
+        }
+        free(old);
+    }
+    e = &t->tab[(id * 2654435761u) & (t->max - 1)];
+    for (; e->used; e = e == &t->tab[t->max - 1] ? t->tab : e + 1)
+        if (e->id == id)
+            return e;
+
+    if (t == &users) {
+        pw = getpwuid(id);
+        s = pw ? pw->pw_name : NULL;
+    } else {
+        gr = getgrgid(id);
+        s = gr ? gr->gr_name : NULL;
+    }
+    e->used = 1;
+    e->id = id;
+    e->name = strdup(s ? s : "???");
+    if (e->name == NULL) {
         fprintf(stderr, "ls: malloc fail\n");
         exit(1);
     }
+    e->len = strlen(e->name);
+    t->n++;
+    return e;
 }
 
-int compar(NDir *a, NDir *b) {
-    long i;
-    struct stat *ad, *bd;
+/*
+ * -C keeps each directory's listing, formatted and sorted, in a file
+ * of its own under $XDG_CACHE_HOME/ls.  While the directory's mtime
+ * and ctime, the flags, the prefix and the column widths it starts
+ * from all match, a rerun maps the file and writes it out, skipping
+ * readdir, stat and sorting.  A file changed in place doesn't touch
+ * its directory, so -l and -s can print it stale.  Files are
+ * replaced by rename, so concurrent runs see a whole listing, old
+ * or new.
+ */
+char *cachedir;
 
-    ad = a->d;
-    bd = b->d;
+uint32_t cflags(void) {
+    return lflag | mflag << 1 | nflag << 2 | pflag << 3 | qflag << 4 |
+        Qflag << 5 | rflag << 6 | sflag << 7 | tflag << 8 | Tflag << 9 |
+        uflag << 10 | Fflag << 11;
+}
 
-    if (tflag) {
-        if (uflag)
-            i = bd->st_atime - ad->st_atime;
+void getwidths(int32_t *w) {
+    w[0] = swidth;
+    w[1] = qwidth;
+    w[2] = vwidth;
+    w[3] = uwidth;
+    w[4] = mwidth;
+    w[5] = lwidth;
+    w[6] = gwidth;
+}
+
+void setwidths(int32_t *w) {
+    swidth = w[0];
+    qwidth = w[1];
+    vwidth = w[2];
+    uwidth = w[3];
+    mwidth = w[4];
+    lwidth = w[5];
+    gwidth = w[6];
+}
+
+/* fill in h's key for directory st printed with prefix pfx */
+void ckey(Chdr *h, struct stat *st, char *pfx) {
+    memset(h, 0, sizeof *h);
+    memcpy(h->magic, CMAGIC, 8);
+    h->version = 1;
+    h->flags = cflags();
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->mns = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    h->cns = st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+    h->day = lflag ? clk / 86400 : 0;
+    getwidths(h->win);
+    h->pfxlen = strlen(pfx);
+}
+
+/* the cache file for h's directory, or NULL without a cache dir */
+char *cpath(Chdr *h, char *pfx) {
+    static char buf[4096];
+    uint64_t x = 14695981039346656037ULL;
+    char *p;
+    uint32_t i;
+
+    if (cachedir == NULL) {
+        if ((p = getenv("XDG_CACHE_HOME")) != NULL && *p)
+            snprintf(buf, sizeof buf, "%s/ls", p);
+        else if ((p = getenv("HOME")) != NULL && *p)
+            snprintf(buf, sizeof buf, "%s/.cache/ls", p);
         else
-            i = bd->st_mtime - ad->st_mtime;
-    } else {
-        if (a->prefix && b->prefix) {
-            i = strcmp(a->prefix, b->prefix);
-            if (i == 0)
-                i = strcmp(a->name, b->name);
-        } else if (a->prefix) {
-            i = strcmp(a->prefix, b->name);
-            if (i == 0)
-                i = 1;  /* a is longer than b */
-        } else if (b->prefix) {
-            i = strcmp(a->name, b->prefix);
-            if (i == 0)
-                i = -1; /* b is longer than a */
-        } else
-            i = strcmp(a->name, b->name);
+            return NULL;
+        if ((cachedir = strdup(buf)) == NULL)
+            return NULL;
+    }
+    /* FNV-1a of everything but the times, which are checked inside */
+    for (p = (char *)&h->flags; p < (char *)&h->mns; p++)
+        x = (x ^ (unsigned char)*p) * 1099511628211ULL;
+    for (p = (char *)&h->day; p < (char *)&h->wout; p++)
+        x = (x ^ (unsigned char)*p) * 1099511628211ULL;
+    for (i = 0; i < h->pfxlen; i++)
+        x = (x ^ (unsigned char)pfx[i]) * 1099511628211ULL;
+    snprintf(buf, sizeof buf, "%s/%016llx", cachedir, (unsigned long long)x);
+    return buf;
+}
+
+/* print the cached listing of st, if there is a good one */
+int chit(struct stat *st, char *pfx) {
+    struct stat cst;
+    Chdr key, *h;
+    char *path, *map;
+    int fd, ok;
+
+    ckey(&key, st, pfx);
+    if ((path = cpath(&key, pfx)) == NULL || (fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    if (fstat(fd, &cst) < 0 || (size_t)cst.st_size < sizeof(Chdr)) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+    h = (Chdr *)map;
+    ok = memcmp(h, &key, offsetof(Chdr, wout)) == 0
+        && h->pfxlen == key.pfxlen
+        && sizeof(Chdr) + h->pfxlen + h->len == (uint64_t)cst.st_size
+        && memcmp(map + sizeof(Chdr), pfx, h->pfxlen) == 0;
+    if (ok) {
+        oflush();
+        owrite(map + sizeof(Chdr) + h->pfxlen, h->len);
+        setwidths(h->wout);
+    }
+    munmap(map, cst.st_size);
+    return ok;
+}
+
+/* start keeping what's printed, with the widths it starts from */
+int32_t capwin[Nwidth];
+
+void cbegin(void) {
+    oflush();
+    getwidths(capwin);
+    ncap = 0;
+    capturing = 1;
+}
+
+/*
+ * Save the listing printed since cbegin as st's, unless st is NULL
+ * (the read failed) or the directory changed too recently for its
+ * times to tell the next change apart.
+ */
+void cend(struct stat *st, char *pfx) {
+    Chdr h;
+    char *path, *tmp;
+    int fd, ok;
+
+    oflush();
+    ok = capturing && st != NULL && time(0) - st->st_ctim.tv_sec > 1;
+    capturing = 0;
+    if (!ok)
+        return;
+    ckey(&h, st, pfx);
+    memcpy(h.win, capwin, sizeof h.win);
+    getwidths(h.wout);
+    h.len = ncap;
+    if ((path = cpath(&h, pfx)) == NULL)
+        return;
+    if (mkdir(cachedir, 0700) < 0 && errno == ENOENT) {
+        /* $HOME/.cache itself may be missing */
+        tmp = strrchr(cachedir, '/');
+        *tmp = 0;
+        mkdir(cachedir, 0700);
+        *tmp = '/';
+        mkdir(cachedir, 0700);
     }
+    if ((tmp = malloc(strlen(path) + 8)) == NULL)
+        return;
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0) {
+        free(tmp);
+        return;
+    }
+    ok = write(fd, &h, sizeof h) == sizeof h
+        && write(fd, pfx, h.pfxlen) == (ssize_t)h.pfxlen
+        && write(fd, cap, ncap) == (ssize_t)ncap;
+    if (close(fd) < 0)
+        ok = 0;
+    if (!ok || rename(tmp, path) < 0)
+        unlink(tmp);
+    free(tmp);
+}
+
+void growto(Ents *e, long n) {
+    if (n <= e->max)
+        return;
+    e->max = n > 2 * e->max ? n : 2 * e->max;
+    e->ent = realloc(e->ent, e->max * sizeof(NDir));
+    if (e->ent == NULL) {
+        fprintf(stderr, "ls: malloc fail\n");
+        exit(1);
+    }
+}
+
+void setstat(NDir *d, struct stat *st) {
+    d->ino = st->st_ino;
+    d->dev = st->st_dev;
+    d->size = st->st_size;
+    d->mtime = st->st_mtime;
+    d->atime = st->st_atime;
+    d->mode = st->st_mode;
+    d->uid = st->st_uid;
+    d->gid = st->st_gid;
+}
+
+/* by name; time order and ties are settled by sortents */
+int compar(NDir *a, NDir *b) {
+    if (a->prefix && b->prefix && a->prefix != b->prefix) {
+        int i = strcmp(a->prefix, b->prefix);
+        return i ? i : strcmp(a->name, b->name);
+    } else if (a->prefix && !b->prefix) {
+        int i = strcmp(a->prefix, b->name);
+        return i ? i : 1;   /* a is longer than b */
+    } else if (b->prefix && !a->prefix) {
+        int i = strcmp(a->name, b->prefix);
+        return i ? i : -1;  /* b is longer than a */
+    }
+    return strcmp(a->name, b->name);
+}
+
+int keycmp(const void *va, const void *vb) {
+    const Skey *a = va, *b = vb;
+    int i;
+
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+    i = compar(&cur.ent[a->i], &cur.ent[b->i]);
     if (i == 0)
-        i = (a < b ? -1 : 1);
-    if (rflag)
-        i = -i;
+        i = a->i < b->i ? -1 : 1;
     return i;
 }
 
+/* -t: the time key, then directory order */
+int tkeycmp(const void *va, const void *vb) {
+    const Skey *a = va, *b = vb;
+
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+    return a->i < b->i ? -1 : 1;
+}
+
+/*
+ * Sort keys, not entries.  By name, the key is the first eight bytes
+ * of the string compared, so most comparisons never leave the key
+ * array; by time, it is the time, flipped so that newest comes first,
+ * with ties in directory order: a small directory is left to qsort,
+ * a big one gets a stable radix sort of a byte a pass, its counts
+ * all taken in one scan.  -r reads the result backwards.
+ */
+void sortents(void) {
+    long count[8][256];
+    uint64_t t;
+    Skey *a, *b, *x;
+    char *s;
+    int i, j, d, samepfx;
+
+    if (cur.n < 2)
+        return;
+    if (tflag) {
+        for (i = 0; i < cur.n; i++) {
+            t = uflag ? cur.ent[i].atime : cur.ent[i].mtime;
+            keys[i].key = ~(t ^ 1ULL << 63);
+        }
+        if (cur.n < Radixmin) {
+            qsort(keys, cur.n, sizeof(Skey), tkeycmp);
+            return;
+        }
+        memset(count, 0, sizeof count);
+        for (i = 0; i < cur.n; i++)
+            for (d = 0; d < 8; d++)
+                count[d][keys[i].key >> 8 * d & 0xff]++;
+        a = keys;
+        b = keytmp;
+        for (d = 0; d < 8; d++) {
+            if (count[d][a[0].key >> 8 * d & 0xff] == cur.n)
+                continue;    /* one digit throughout: nothing to do */
+            for (i = 0, t = 0; i < 256; i++) {
+                j = count[d][i];
+                count[d][i] = t;
+                t += j;
+            }
+            for (i = 0; i < cur.n; i++)
+                b[count[d][a[i].key >> 8 * d & 0xff]++] = a[i];
+            x = a;
+            a = b;
+            b = x;
+        }
+        if (a != keys)
+            memcpy(keys, a, cur.n * sizeof(Skey));
+        return;
+    }
+
+    /* a directory's entries share one prefix, so the name decides */
+    samepfx = 1;
+    for (i = 1; i < cur.n && samepfx; i++)
+        samepfx = cur.ent[i].prefix == cur.ent[0].prefix;
+    for (i = 0; i < cur.n; i++) {
+        s = cur.ent[i].name;
+        if (!samepfx && cur.ent[i].prefix)
+            s = cur.ent[i].prefix;
+        for (t = 0, j = 0; j < 8; j++) {
+            t = t << 8 | (unsigned char)*s;
+            if (*s)
+                s++;
+        }
+        keys[i].key = t;
+    }
+    qsort(keys, cur.n, sizeof(Skey), keycmp);
+}
+
+/*
+ * Listings share few distinct minutes, so each one's string is kept
+ * in a small table rather than remade by ctime for every entry.
+ */
 char *asciitime(time_t l) {
-    static char buf[32];
+    static struct {
+        time_t min;
+        int old;
+        char buf[13];
+    } tc[Ntime];
     char *t;
+    int old, h;
 
-    t = ctime(&l);
     /* 6 months in the past or a day in the future */
-    if (l < clk - 180L * 24 * 60 * 60 || clk + 24L * 60 * 60 < l) {
-        memmove(buf, t + 4, 7);      /* month and day */
-        memmove(buf + 7, t + 20, 4); /* year */
+    old = l < clk - 180L * 24 * 60 * 60 || clk + 24L * 60 * 60 < l;
+    h = (unsigned long)(l / 60) % Ntime;
+    if (tc[h].buf[0] && tc[h].min == l / 60 && tc[h].old == old)
+        return tc[h].buf;
+    t = ctime(&l);
+    if (old) {
+        memmove(tc[h].buf, t + 4, 7);      /* month and day */
+        memmove(tc[h].buf + 7, t + 20, 4); /* year */
+        tc[h].buf[11] = 0;
     } else
-        memmove(buf, t + 4, 12);     /* skip day of week */
-    buf[12] = 0;
-    return buf;
+        memmove(tc[h].buf, t + 4, 12);     /* skip day of week */
+    tc[h].buf[12] = 0;
+    tc[h].min = l / 60;
+    tc[h].old = old;
+    return tc[h].buf;
 }
 
 void rwx(mode_t mode, char *buf) {